@@ -12,8 +12,8 @@
 #ifndef LLVM_FUZZER_CORPUS
 #define LLVM_FUZZER_CORPUS
 
+#include <memory>
 #include <random>
-#include <unordered_set>
 
 #include "FuzzerDefs.h"
 #include "FuzzerRandom.h"
@@ -21,104 +21,277 @@
 
 namespace fuzzer {
 
-struct InputInfo {
-  Unit U;  // The actual input data.
-  uint8_t Sha1[kSHA1NumBytes];  // Checksum.
-  // Number of features that this input has and no smaller input has.
-  size_t NumFeatures = 0;
-  size_t Tmp = 0; // Used by ValidateFeatureSet.
-  // Stats.
-  size_t NumExecutedMutations = 0;
-  size_t NumSuccessfullMutations = 0;
-  bool MayDeleteFile = false;
+// A unit stored in an InputCorpus. Only valid until the next AddToCorpus.
+struct UnitRef {
+  const uint8_t *Data;
+  size_t Size;
+  const uint8_t *data() const { return Data; }
+  size_t size() const { return Size; }
+  bool empty() const { return Size == 0; }
 };
 
-class InputCorpus {
+// Storage for the bytes of the units in a corpus, packed back to back
+// into large chunks rather than kept in a heap block each. Nothing is
+// ever freed individually; the corpus compacts into a fresh arena instead.
+class UnitArena {
  public:
-  static const size_t kFeatureSetSize = 1 << 16;
-  InputCorpus(const std::string &OutputCorpus) : OutputCorpus(OutputCorpus) {
-    memset(InputSizesPerFeature, 0, sizeof(InputSizesPerFeature));
-    memset(SmallestElementPerFeature, 0, sizeof(SmallestElementPerFeature));
+  static const size_t kChunkSize = 1 << 20;
+
+  uint8_t *Allocate(size_t Size) {
+    if (Chunks.empty() || ChunkUsed + Size > ChunkSize)
+      NewChunk(Size > kChunkSize ? Size : kChunkSize);
+    uint8_t *Res = Chunks.back().get() + ChunkUsed;
+    ChunkUsed += Size;
+    return Res;
   }
-  ~InputCorpus() {
-    for (auto II : Inputs)
-      delete II;
+
+  // Bytes allocated from the system, used or not.
+  size_t Capacity() const { return TotalCapacity; }
+
+  void swap(UnitArena &Other) {
+    Chunks.swap(Other.Chunks);
+    std::swap(ChunkSize, Other.ChunkSize);
+    std::swap(ChunkUsed, Other.ChunkUsed);
+    std::swap(TotalCapacity, Other.TotalCapacity);
   }
-  size_t size() const { return Inputs.size(); }
-  size_t SizeInBytes() const {
-    size_t Res = 0;
-    for (auto II : Inputs)
-      Res += II->U.size();
-    return Res;
+
+ private:
+  void NewChunk(size_t Size) {
+    Chunks.emplace_back(new uint8_t[Size]);
+    ChunkSize = Size;
+    ChunkUsed = 0;
+    TotalCapacity += Size;
   }
-  size_t NumActiveUnits() const {
-    size_t Res = 0;
-    for (auto II : Inputs)
-      Res += !II->U.empty();
+
+  std::vector<std::unique_ptr<uint8_t[]>> Chunks;
+  size_t ChunkSize = 0;  // Of the last chunk, the only one with room left.
+  size_t ChunkUsed = 0;
+  size_t TotalCapacity = 0;
+};
+
+// A set of SHA1 digests, stored as raw bytes in one flat open-addressing
+// table rather than as hex strings in separate allocations.
+class Sha1Set {
+ public:
+  size_t size() const { return NumElements; }
+
+  bool count(const uint8_t Sha1[kSHA1NumBytes]) const {
+    if (Slots.empty()) return false;
+    for (size_t i = Start(Sha1);; i = (i + 1) & Mask()) {
+      if (!Used[i]) return false;
+      if (!memcmp(Slots[i].Bytes, Sha1, kSHA1NumBytes)) return true;
+    }
+  }
+
+  // Returns false if Sha1 was already there.
+  bool insert(const uint8_t Sha1[kSHA1NumBytes]) {
+    if (2 * (NumElements + 1) > Slots.size())
+      Grow();
+    size_t i = Start(Sha1);
+    for (; Used[i]; i = (i + 1) & Mask())
+      if (!memcmp(Slots[i].Bytes, Sha1, kSHA1NumBytes)) return false;
+    memcpy(Slots[i].Bytes, Sha1, kSHA1NumBytes);
+    Used[i] = 1;
+    NumElements++;
+    return true;
+  }
+
+ private:
+  struct Digest { uint8_t Bytes[kSHA1NumBytes]; };
+
+  size_t Mask() const { return Slots.size() - 1; }
+  // SHA1 output is uniform already, so its first bytes make a fine hash.
+  size_t Start(const uint8_t *Sha1) const {
+    size_t H;
+    memcpy(&H, Sha1, sizeof(H));
+    return H & Mask();
+  }
+
+  void Grow() {
+    std::vector<Digest> OldSlots(Slots.empty() ? 64 : 2 * Slots.size());
+    std::vector<uint8_t> OldUsed(OldSlots.size());
+    OldSlots.swap(Slots);
+    OldUsed.swap(Used);
+    NumElements = 0;
+    for (size_t i = 0; i < OldSlots.size(); i++)
+      if (OldUsed[i])
+        insert(OldSlots[i].Bytes);
+  }
+
+  std::vector<Digest> Slots;  // Size is 0 or a power of two.
+  std::vector<uint8_t> Used;
+  size_t NumElements = 0;
+};
+
+// Non-negative integer weights of the units in the corpus, kept in a
+// Fenwick tree so that a weight can be changed, a weight appended and a
+// unit picked with probability proportional to its weight in O(log N).
+class WeightedSampler {
+ public:
+  size_t size() const { return Weights.size(); }
+  uint64_t Total() const { return Prefix(size()); }
+  uint64_t Weight(size_t Idx) const { return Weights[Idx]; }
+
+  void push_back(uint64_t W) {
+    Weights.push_back(W);
+    size_t N = size();
+    // Tree[N] covers the weights (N - LowBit(N), N].
+    Tree.push_back(W + Prefix(N - 1) - Prefix(N - LowBit(N)));
+  }
+
+  void Set(size_t Idx, uint64_t W) {
+    uint64_t Old = Weights[Idx];
+    Weights[Idx] = W;
+    for (size_t i = Idx + 1; i <= size(); i += LowBit(i))
+      Tree[i] += W - Old;  // Wraps around correctly when W < Old.
+  }
+
+  // Replaces all the weights at once in O(N).
+  void Assign(const std::vector<uint64_t> &NewWeights) {
+    Weights = NewWeights;
+    Tree.assign(1, 0);
+    Tree.insert(Tree.end(), Weights.begin(), Weights.end());
+    for (size_t i = 1; i <= size(); i++) {
+      size_t Parent = i + LowBit(i);
+      if (Parent <= size())
+        Tree[Parent] += Tree[i];
+    }
+  }
+
+  // Returns the Idx such that the weights before it add up to at most
+  // Point and the weights up to and including it to more than Point,
+  // i.e. never a unit of weight 0. Point must be less than Total().
+  size_t Find(uint64_t Point) const {
+    size_t Pos = 0;
+    size_t Step = 1;
+    while (Step * 2 <= size())
+      Step *= 2;
+    for (; Step; Step /= 2) {
+      if (Pos + Step <= size() && Tree[Pos + Step] <= Point) {
+        Pos += Step;
+        Point -= Tree[Pos];
+      }
+    }
+    assert(Pos < size());
+    return Pos;
+  }
+
+ private:
+  static size_t LowBit(size_t i) { return i & (~i + 1); }
+
+  // Sum of the first N weights.
+  uint64_t Prefix(size_t N) const {
+    uint64_t Res = 0;
+    for (; N; N -= LowBit(N))
+      Res += Tree[N];
     return Res;
   }
-  bool empty() const { return Inputs.empty(); }
-  const Unit &operator[] (size_t Idx) const { return Inputs[Idx]->U; }
+
+  std::vector<uint64_t> Weights;
+  std::vector<uint64_t> Tree = {0};  // 1-based.
+};
+
+class InputCorpus {
+ public:
+  // Features are indexed directly up to here and folded beyond it.
+  static const size_t kFeatureSetSize = 1 << 30;
+  InputCorpus(const std::string &OutputCorpus, bool ValidateFeatures = false)
+      : ValidateFeatures(ValidateFeatures), OutputCorpus(OutputCorpus) {}
+  size_t size() const { return UnitData.size(); }
+  size_t SizeInBytes() const { return LiveBytes; }
+  size_t NumActiveUnits() const { return NumLiveUnits; }
+  // Bytes the unit data takes up, including evicted units not yet
+  // compacted away.
+  size_t ArenaCapacity() const { return Arena.Capacity(); }
+  bool empty() const { return UnitData.empty(); }
+  UnitRef operator[] (size_t Idx) const {
+    return {UnitData[Idx], UnitSizes[Idx]};
+  }
+  const uint8_t *Sha1(size_t Idx) const {
+    return &Sha1s[Idx * kSHA1NumBytes];
+  }
   void AddToCorpus(const Unit &U, size_t NumFeatures, bool MayDeleteFile = false) {
-    assert(!U.empty());
+    AddToCorpus(U.data(), U.size(), NumFeatures, MayDeleteFile);
+  }
+  void AddToCorpus(const uint8_t *Data, size_t Size, size_t NumFeatures,
+                   bool MayDeleteFile = false) {
+    assert(Size);
     uint8_t Hash[kSHA1NumBytes];
     if (FeatureDebug)
-      Printf("ADD_TO_CORPUS %zd NF %zd\n", Inputs.size(), NumFeatures);
-    ComputeSHA1(U.data(), U.size(), Hash);
-    Hashes.insert(Sha1ToString(Hash));
-    Inputs.push_back(new InputInfo());
-    InputInfo &II = *Inputs.back();
-    II.U = U;
-    II.NumFeatures = NumFeatures;
-    II.MayDeleteFile = MayDeleteFile;
-    memcpy(II.Sha1, Hash, kSHA1NumBytes);
-    UpdateCorpusDistribution();
+      Printf("ADD_TO_CORPUS %zd NF %zd\n", size(), NumFeatures);
+    ComputeSHA1(Data, Size, Hash);
+    Hashes.insert(Hash);
+    uint8_t *Copy = Arena.Allocate(Size);
+    memcpy(Copy, Data, Size);
+    UnitData.push_back(Copy);
+    UnitSizes.push_back(static_cast<uint32_t>(Size));
+    Sha1s.insert(Sha1s.end(), Hash, Hash + kSHA1NumBytes);
+    NumFeaturesPerUnit.push_back(NumFeatures);
+    NumExecutedMutations.push_back(0);
+    NumSuccessfullMutations.push_back(0);
+    MayDeleteFiles.push_back(MayDeleteFile);
+    LiveBytes += Size;
+    NumLiveUnits++;
+    Sampler.push_back(UnitWeight(size() - 1));
     ValidateFeatureSet();
+    if (DeadBytes > UnitArena::kChunkSize && DeadBytes > LiveBytes)
+      Compact();
   }
 
-  bool HasUnit(const Unit &U) { return Hashes.count(Hash(U)); }
-  bool HasUnit(const std::string &H) { return Hashes.count(H); }
-  InputInfo &ChooseUnitToMutate(Random &Rand) {
-    InputInfo &II = *Inputs[ChooseUnitIdxToMutate(Rand)];
-    assert(!II.U.empty());
-    return II;
-  };
+  bool HasUnit(const Unit &U) {
+    uint8_t Hash[kSHA1NumBytes];
+    ComputeSHA1(U.data(), U.size(), Hash);
+    return Hashes.count(Hash);
+  }
+  bool HasUnit(const std::string &H) {
+    uint8_t Hash[kSHA1NumBytes];
+    return ParseSha1(H, Hash) && Hashes.count(Hash);
+  }
 
   // Returns an index of random unit from the corpus to mutate.
   // Hypothesis: units added to the corpus last are more likely to be
   // interesting. This function gives more weight to the more recent units.
   size_t ChooseUnitIdxToMutate(Random &Rand) {
-    size_t Idx = static_cast<size_t>(CorpusDistribution(Rand.Get_mt19937()));
-    assert(Idx < Inputs.size());
+    assert(!empty());
+    uint64_t Total = Sampler.Total();
+    if (!Total) return size() - 1;
+    std::uniform_int_distribution<uint64_t> Point(0, Total - 1);
+    size_t Idx = Sampler.Find(Point(Rand.Get_mt19937()));
+    assert(Idx < size());
     return Idx;
   }
 
+  void RecordExecutedMutation(size_t Idx) { NumExecutedMutations[Idx]++; }
+  void RecordSuccessfulMutation(size_t Idx) { NumSuccessfullMutations[Idx]++; }
+
   void PrintStats() {
-    for (size_t i = 0; i < Inputs.size(); i++) {
-      const auto &II = *Inputs[i];
+    for (size_t i = 0; i < size(); i++)
       Printf("  [%zd %s]\tsz: %zd\truns: %zd\tsucc: %zd\n", i,
-             Sha1ToString(II.Sha1).c_str(), II.U.size(),
-             II.NumExecutedMutations, II.NumSuccessfullMutations);
-    }
+             Sha1ToString(Sha1(i)).c_str(), (size_t)UnitSizes[i],
+             NumExecutedMutations[i], NumSuccessfullMutations[i]);
   }
 
   void PrintFeatureSet() {
-    for (size_t i = 0; i < kFeatureSetSize; i++) {
+    for (size_t i = 0; i < NumFeatureSlots(); i++) {
       if(size_t Sz = GetFeature(i))
-        Printf("[%zd: id %zd sz%zd] ", i, SmallestElementPerFeature[i], Sz);
+        Printf("[%zd: id %zd sz%zd] ", i,
+               (size_t)GetFeatureInfo(i).SmallestElement, Sz);
     }
     Printf("\n\t");
-    for (size_t i = 0; i < Inputs.size(); i++)
-      if (size_t N = Inputs[i]->NumFeatures)
+    for (size_t i = 0; i < size(); i++)
+      if (size_t N = NumFeaturesPerUnit[i])
         Printf(" %zd=>%zd ", i, N);
     Printf("\n");
   }
 
   void DeleteInput(size_t Idx) {
-    InputInfo &II = *Inputs[Idx];
-    if (!OutputCorpus.empty() && II.MayDeleteFile)
-      DeleteFile(DirPlusFile(OutputCorpus, Sha1ToString(II.Sha1)));
-    Unit().swap(II.U);
+    if (!OutputCorpus.empty() && MayDeleteFiles[Idx])
+      DeleteFile(DirPlusFile(OutputCorpus, Sha1ToString(Sha1(Idx))));
+    // The bytes stay in the arena until the next Compact.
+    LiveBytes -= UnitSizes[Idx];
+    DeadBytes += UnitSizes[Idx];
+    NumLiveUnits--;
+    UnitSizes[Idx] = 0;
     if (FeatureDebug)
       Printf("EVICTED %zd\n", Idx);
   }
@@ -128,84 +301,178 @@ class InputCorpus {
     Idx = Idx % kFeatureSetSize;
     uint32_t OldSize = GetFeature(Idx);
     if (OldSize == 0 || (Shrink && OldSize > NewSize)) {
+      if (OldSize == 0)
+        NumSetFeatures++;
       if (OldSize > 0) {
-        size_t OldIdx = SmallestElementPerFeature[Idx];
-        InputInfo &II = *Inputs[OldIdx];
-        assert(II.NumFeatures > 0);
-        II.NumFeatures--;
-        if (II.NumFeatures == 0)
+        size_t OldIdx = GetFeatureInfo(Idx).SmallestElement;
+        assert(NumFeaturesPerUnit[OldIdx] > 0);
+        NumFeaturesPerUnit[OldIdx]--;
+        Sampler.Set(OldIdx, UnitWeight(OldIdx));
+        if (NumFeaturesPerUnit[OldIdx] == 0)
           DeleteInput(OldIdx);
       }
       if (FeatureDebug)
         Printf("ADD FEATURE %zd sz %d\n", Idx, NewSize);
-      SmallestElementPerFeature[Idx] = Inputs.size();
-      InputSizesPerFeature[Idx] = NewSize;
-      CountingFeatures = true;
+      FeatureInfo &FI = GetFeatureInfo(Idx);
+      FI.SmallestElement = static_cast<uint32_t>(size());
+      FI.InputSize = NewSize;
+      if (!CountingFeatures) {
+        CountingFeatures = true;
+        UpdateCorpusDistribution();
+      }
+      AddedFeatures.push_back(static_cast<uint32_t>(Idx));
       return true;
     }
     return false;
   }
 
-  size_t NumFeatures() const {
+  // AddFeature for each of Features. Returns how many were added.
+  size_t AddFeatures(const uint32_t *Features, size_t NumFeatures,
+                     uint32_t NewSize, bool Shrink) {
     size_t Res = 0;
-    for (size_t i = 0; i < kFeatureSetSize; i++)
-      Res += GetFeature(i) != 0;
+    for (size_t i = 0; i < NumFeatures; i++)
+      Res += AddFeature(Features[i], NewSize, Shrink);
     return Res;
   }
 
+  bool HasFeatures(const uint32_t *Features, size_t NumFeatures) const {
+    for (size_t i = 0; i < NumFeatures; i++)
+      if (!GetFeature(Features[i]))
+        return false;
+    return true;
+  }
+
+  // Features added since the last call to ClearAddedFeatures, i.e. by the
+  // unit that has just been executed.
+  const std::vector<uint32_t> &GetAddedFeatures() const {
+    return AddedFeatures;
+  }
+  void ClearAddedFeatures() { AddedFeatures.clear(); }
+
+  size_t NumFeatures() const { return NumSetFeatures; }
+
   void ResetFeatureSet() {
-    assert(Inputs.empty());
-    memset(InputSizesPerFeature, 0, sizeof(InputSizesPerFeature));
-    memset(SmallestElementPerFeature, 0, sizeof(SmallestElementPerFeature));
+    assert(empty());
+    FeaturePages.clear();
+    NumSetFeatures = 0;
   }
 
 private:
 
   static const bool FeatureDebug = false;
 
-  size_t GetFeature(size_t Idx) const { return InputSizesPerFeature[Idx]; }
+  // The feature set is a two-level table indexed by feature: a page of
+  // FeatureInfo is only allocated once one of its features is set, so it
+  // grows with the part of the program that is actually reached.
+  struct FeatureInfo {
+    uint32_t InputSize;  // Of the smallest input with the feature, 0 if none.
+    uint32_t SmallestElement;  // Index of that input.
+  };
+  static const size_t kFeaturePageBits = 12;
+  static const size_t kFeaturePageSize = 1 << kFeaturePageBits;
+
+  size_t NumFeatureSlots() const {
+    return FeaturePages.size() << kFeaturePageBits;
+  }
+
+  size_t GetFeature(size_t Idx) const {
+    size_t Page = Idx >> kFeaturePageBits;
+    if (Page >= FeaturePages.size() || !FeaturePages[Page]) return 0;
+    return FeaturePages[Page][Idx & (kFeaturePageSize - 1)].InputSize;
+  }
+
+  FeatureInfo &GetFeatureInfo(size_t Idx) {
+    size_t Page = Idx >> kFeaturePageBits;
+    if (Page >= FeaturePages.size())
+      FeaturePages.resize(Page + 1);
+    if (!FeaturePages[Page])
+      FeaturePages[Page].reset(new FeatureInfo[kFeaturePageSize]());
+    return FeaturePages[Page][Idx & (kFeaturePageSize - 1)];
+  }
 
+  // AddFeature keeps every input's NumFeatures and NumSetFeatures up to
+  // date as it goes. This checks them against a full scan of the feature
+  // set, which is too slow to do for every unit unless asked to.
   void ValidateFeatureSet() {
-    if (!CountingFeatures) return;
+    if (!CountingFeatures || !(ValidateFeatures || FeatureDebug)) return;
     if (FeatureDebug)
       PrintFeatureSet();
-    for (size_t Idx = 0; Idx < kFeatureSetSize; Idx++)
-      if (GetFeature(Idx))
-        Inputs[SmallestElementPerFeature[Idx]]->Tmp++;
-    for (auto II: Inputs) {
-      if (II->Tmp != II->NumFeatures)
-        Printf("ZZZ %zd %zd\n", II->Tmp, II->NumFeatures);
-      assert(II->Tmp == II->NumFeatures);
-      II->Tmp = 0;
+    size_t NumSet = 0;
+    std::vector<size_t> Owned(size());
+    for (size_t Idx = 0; Idx < NumFeatureSlots(); Idx++)
+      if (GetFeature(Idx)) {
+        Owned[GetFeatureInfo(Idx).SmallestElement]++;
+        NumSet++;
+      }
+    if (NumSet != NumSetFeatures)
+      Printf("ZZZ features %zd %zd\n", NumSet, NumSetFeatures);
+    assert(NumSet == NumSetFeatures);
+    for (size_t i = 0; i < size(); i++) {
+      if (Owned[i] != NumFeaturesPerUnit[i])
+        Printf("ZZZ %zd %zd\n", Owned[i], NumFeaturesPerUnit[i]);
+      assert(Owned[i] == NumFeaturesPerUnit[i]);
     }
   }
 
-  // Updates the probability distribution for the units in the corpus.
-  // Must be called whenever the corpus or unit weights are changed.
-  void UpdateCorpusDistribution() {
-    size_t N = Inputs.size();
-    Intervals.resize(N + 1);
-    Weights.resize(N);
-    std::iota(Intervals.begin(), Intervals.end(), 0);
+  // Moves the units that have not been evicted into a fresh arena and
+  // frees the old one. Indices stay the same.
+  void Compact() {
+    UnitArena NewArena;
+    for (size_t i = 0; i < size(); i++) {
+      if (!UnitSizes[i]) {
+        UnitData[i] = nullptr;
+        continue;
+      }
+      uint8_t *Copy = NewArena.Allocate(UnitSizes[i]);
+      memcpy(Copy, UnitData[i], UnitSizes[i]);
+      UnitData[i] = Copy;
+    }
+    Arena.swap(NewArena);
+    DeadBytes = 0;
+  }
+
+  // The weight unit Idx is chosen for mutation with. Later units weigh
+  // more, and once features are counted so do units with more features.
+  uint64_t UnitWeight(size_t Idx) const {
     if (CountingFeatures)
-      for (size_t i = 0; i < N; i++)
-        Weights[i] = Inputs[i]->NumFeatures * (i + 1);
-    else
-      std::iota(Weights.begin(), Weights.end(), 1);
-    CorpusDistribution = std::piecewise_constant_distribution<double>(
-        Intervals.begin(), Intervals.end(), Weights.begin());
+      return static_cast<uint64_t>(NumFeaturesPerUnit[Idx]) * (Idx + 1);
+    return Idx + 1;
   }
-  std::piecewise_constant_distribution<double> CorpusDistribution;
 
-  std::vector<double> Intervals;
-  std::vector<double> Weights;
+  // Recomputes the weights of all the units in O(N). Adding a unit or
+  // changing its NumFeatures updates just its own weight instead, this is
+  // only needed when the weighting itself changes.
+  void UpdateCorpusDistribution() {
+    std::vector<uint64_t> Weights(size());
+    for (size_t i = 0; i < size(); i++)
+      Weights[i] = UnitWeight(i);
+    Sampler.Assign(Weights);
+  }
+  WeightedSampler Sampler;
 
-  std::unordered_set<std::string> Hashes;
-  std::vector<InputInfo*> Inputs;
+  Sha1Set Hashes;
+
+  // The units, one entry per unit in each vector. Evicted units keep
+  // their entries, with a size of 0.
+  UnitArena Arena;
+  std::vector<const uint8_t *> UnitData;
+  std::vector<uint32_t> UnitSizes;
+  std::vector<uint8_t> Sha1s;  // kSHA1NumBytes per unit.
+  // Number of features that the unit has and no smaller unit has.
+  std::vector<size_t> NumFeaturesPerUnit;
+  // Stats.
+  std::vector<size_t> NumExecutedMutations;
+  std::vector<size_t> NumSuccessfullMutations;
+  std::vector<bool> MayDeleteFiles;
+  size_t LiveBytes = 0;
+  size_t DeadBytes = 0;
+  size_t NumLiveUnits = 0;
 
   bool CountingFeatures = false;
-  uint32_t InputSizesPerFeature[kFeatureSetSize];
-  uint32_t SmallestElementPerFeature[kFeatureSetSize];
+  bool ValidateFeatures;
+  size_t NumSetFeatures = 0;
+  std::vector<std::unique_ptr<FeatureInfo[]>> FeaturePages;
+  std::vector<uint32_t> AddedFeatures;
 
   std::string OutputCorpus;
 };
@@ -31,8 +31,10 @@
 
 #ifdef __x86_64
 #define ATTRIBUTE_TARGET_POPCNT __attribute__((target("popcnt")))
+#define ATTRIBUTE_TARGET_AVX2 __attribute__((target("avx2")))
 #else
 #define ATTRIBUTE_TARGET_POPCNT
+#define ATTRIBUTE_TARGET_AVX2
 #endif
 
 namespace fuzzer {
@@ -46,8 +48,9 @@ class DictionaryEntry;
 class MutationDispatcher;
 struct FuzzingOptions;
 class InputCorpus;
-struct InputInfo;
 struct ExternalFunctions;
+class SharedCorpus;
+class CorpusStore;
 
 // Global interface to functions that may or may not be available.
 extern ExternalFunctions *EF;
@@ -55,7 +58,37 @@ extern ExternalFunctions *EF;
 typedef std::vector<uint8_t> Unit;
 typedef std::vector<Unit> UnitVector;
 typedef int (*UserCallback)(const uint8_t *Data, size_t Size);
+
+// Somewhere other than a directory to keep the output corpus in, e.g. a
+// database table.
+class CorpusStore {
+ public:
+  virtual ~CorpusStore() {}
+  // Appends the units stored since the previous call (all of them the
+  // first time) to *V, truncated to MaxSize.
+  virtual void ReadNewUnits(UnitVector *V, size_t MaxSize) = 0;
+  // Stores U. NumFeatures is 0 if not known.
+  virtual void WriteUnit(const Unit &U, const std::string &Sha1,
+                         size_t NumFeatures) = 0;
+};
 int FuzzerDriver(int *argc, char ***argv, UserCallback Callback);
+// Releases the process-wide state left behind by FuzzerDriver (the current
+// Fuzzer, signal handlers, timers) so that it can be called again.
+void ResetFuzzerDriver();
+// Makes the next FuzzerDriver call exchange new units with the other
+// processes attached to SC. Cleared by ResetFuzzerDriver.
+void SetSharedCorpus(SharedCorpus *SC);
+// Makes the next FuzzerDriver call run the fuzzing loop in forked children
+// that execute Batch inputs each, see Fuzzer::ForkServerLoop. ChildStart and
+// ChildExit (may be null) run in each child before the first and after the
+// last input. ShouldStop (may be null) is polled by the parent while a child
+// runs; once it returns true the child gets SIGINT and no more are started.
+// Cleared by ResetFuzzerDriver.
+void SetForkServer(size_t Batch, void (*ChildStart)(), void (*ChildExit)(),
+                   bool (*ShouldStop)());
+// Makes the next FuzzerDriver call load and save its corpus through CS
+// rather than the output corpus directory. Cleared by ResetFuzzerDriver.
+void SetCorpusStore(CorpusStore *CS);
 
 bool IsFile(const std::string &Path);
 long GetEpoch(const std::string &Path);
@@ -67,6 +100,12 @@ void ReadDirToVectorOfUnits(const char *Path, std::vector<Unit> *V,
 void WriteToFile(const Unit &U, const std::string &Path);
 void CopyFileToErr(const std::string &Path);
 void DeleteFile(const std::string &Path);
+// Maps the file at Path into memory that is shared with every process that
+// maps the same file. If Create is set the file must not exist yet and is
+// created with *Size bytes, otherwise *Size is set to the size of the file.
+// Returns nullptr on failure.
+void *MapSharedFile(const std::string &Path, size_t *Size, bool Create);
+void UnmapSharedFile(void *Mem, size_t Size);
 // Returns "Dir/FileName" or equivalent for the current OS.
 std::string DirPlusFile(const std::string &DirPath,
                         const std::string &FileName);
@@ -91,6 +130,7 @@ void SetSigIllHandler();
 void SetSigFpeHandler();
 void SetSigIntHandler();
 void SetSigTermHandler();
+void RestoreSignalHandlers();
 std::string Base64(const Unit &U);
 int ExecuteCommand(const std::string &Command);
 bool ExecuteCommandAndReadOutput(const std::string &Command, std::string *Out);
@@ -102,6 +142,8 @@ static const int kSHA1NumBytes = 20;
 // Computes SHA1 hash of 'Len' bytes in 'Data', writes kSHA1NumBytes to 'Out'.
 void ComputeSHA1(const uint8_t *Data, size_t Len, uint8_t *Out);
 std::string Sha1ToString(const uint8_t Sha1[kSHA1NumBytes]);
+// The reverse of Sha1ToString. Returns false if Str is not 40 hex digits.
+bool ParseSha1(const std::string &Str, uint8_t Sha1[kSHA1NumBytes]);
 
 // Changes U to contain only ASCII (isprint+isspace) characters.
 // Returns true iff U has been changed.
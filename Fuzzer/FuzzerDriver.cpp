@@ -14,10 +14,12 @@
 #include "FuzzerInternal.h"
 #include "FuzzerMutate.h"
 #include "FuzzerRandom.h"
+#include "FuzzerSharedCorpus.h"
 
 #include <algorithm>
 #include <atomic>
 #include <chrono>
+#include <cstdlib>
 #include <cstring>
 #include <mutex>
 #include <string>
@@ -74,6 +76,12 @@ static const size_t kNumFlags =
 
 static std::vector<std::string> *Inputs;
 static std::string *ProgName;
+static SharedCorpus *CorpusToShare;
+static CorpusStore *StoreToUse;
+static size_t ForkServerBatch;
+static void (*ForkChildStart)();
+static void (*ForkChildExit)();
+static bool (*ForkShouldStop)();
 
 static void PrintHelp() {
   Printf("Usage:\n");
@@ -183,6 +191,7 @@ static void ParseFlags(const std::vector<std::string> &Args) {
     if (FlagDescriptions[F].StrFlag)
       *FlagDescriptions[F].StrFlag = nullptr;
   }
+  delete Inputs;
   Inputs = new std::vector<std::string>;
   for (size_t A = 1; A < Args.size(); A++) {
     if (ParseOneFlag(Args[A].c_str())) continue;
@@ -235,11 +244,66 @@ static std::string CloneArgsWithoutX(const std::vector<std::string> &Args,
   return CloneArgsWithoutX(Args, X, X);
 }
 
+// Number and maximal size of the units in the ring that -jobs sets up for
+// its workers; the ring takes up to 16Mb of shared memory. Larger units
+// still reach the others through the corpus directory.
+static const size_t kNumSharedUnits = 4096;
+static const size_t kMaxSharedUnitSize = 4096;
+
+// Creates the file behind the shared corpus of a -jobs run, preferring
+// /dev/shm so that it never goes to disk.
+static void *CreateSharedCorpusFile(size_t MaxUnitSize, std::string *Path,
+                                    size_t *Size) {
+  *Size = SharedCorpus::SizeFor(kNumSharedUnits, MaxUnitSize);
+  std::string Name = "libFuzzer-" + std::to_string(GetPid()) + ".corpus";
+  const char *TmpDir = getenv("TMPDIR");
+  for (const char *Dir : {"/dev/shm", TmpDir ? TmpDir : "/tmp"}) {
+    *Path = DirPlusFile(Dir, Name);
+    if (void *Mem = MapSharedFile(*Path, Size, /*Create=*/true)) {
+      // A freshly truncated file reads as zeros already.
+      SharedCorpus::Create(Mem, kNumSharedUnits, MaxUnitSize,
+                           /*MemIsZeroed=*/true);
+      return Mem;
+    }
+  }
+  Printf("WARNING: could not create a shared corpus, workers will only "
+         "sync through the corpus directory\n");
+  return nullptr;
+}
+
+static SharedCorpus *JoinSharedCorpusFile(const std::string &Path) {
+  size_t Size = 0;
+  void *Mem = MapSharedFile(Path, &Size, /*Create=*/false);
+  if (!Mem) {
+    Printf("WARNING: could not map shared corpus %s\n", Path.c_str());
+    return nullptr;
+  }
+  SharedCorpus *SC = SharedCorpus::Attach(Mem, Size);
+  if (!SC) {
+    Printf("WARNING: %s does not hold a shared corpus\n", Path.c_str());
+    UnmapSharedFile(Mem, Size);
+  }
+  return SC;
+}
+
 static int RunInMultipleProcesses(const std::vector<std::string> &Args,
                                   int NumWorkers, int NumJobs) {
   std::atomic<int> Counter(0);
   std::atomic<bool> HasErrors(false);
   std::string Cmd = CloneArgsWithoutX(Args, "jobs", "workers");
+  // The workers pass each other their new units through shared memory, so
+  // that they see them right away instead of on the next -reload.
+  std::string SharedPath;
+  size_t SharedSize = 0;
+  void *Shared = nullptr;
+  if (!Flags.shared_corpus)
+    Shared = CreateSharedCorpusFile(
+        Flags.max_len > 0 ? std::min(static_cast<size_t>(Flags.max_len),
+                                     kMaxSharedUnitSize)
+                          : kMaxSharedUnitSize,
+        &SharedPath, &SharedSize);
+  if (Shared)
+    Cmd += "-shared_corpus=" + SharedPath + " ";
   std::vector<std::thread> V;
   std::thread Pulse(PulseThread);
   Pulse.detach();
@@ -247,21 +311,34 @@ static int RunInMultipleProcesses(const std::vector<std::string> &Args,
     V.push_back(std::thread(WorkerThread, Cmd, &Counter, NumJobs, &HasErrors));
   for (auto &T : V)
     T.join();
+  if (Shared) {
+    UnmapSharedFile(Shared, SharedSize);
+    DeleteFile(SharedPath);
+  }
   return HasErrors ? 1 : 0;
 }
 
-static void RssThread(Fuzzer *F, size_t RssLimitMb) {
+// The rss thread outlives any single FuzzerDriver call, so it only ever
+// talks to whichever Fuzzer is current and reads the limit afresh.
+static std::atomic<size_t> CurrentRssLimitMb;
+
+static void RssThread() {
   while (true) {
     SleepSeconds(1);
+    size_t RssLimitMb = CurrentRssLimitMb;
+    if (!RssLimitMb) continue;
     size_t Peak = GetPeakRSSMb();
     if (Peak > RssLimitMb)
-      F->RssLimitCallback();
+      Fuzzer::StaticRssLimitCallback();
   }
 }
 
-static void StartRssThread(Fuzzer *F, size_t RssLimitMb) {
-  if (!RssLimitMb) return;
-  std::thread T(RssThread, F, RssLimitMb);
+static void StartRssThread(size_t RssLimitMb) {
+  static bool Started = false;
+  CurrentRssLimitMb = RssLimitMb;
+  if (!RssLimitMb || Started) return;
+  Started = true;
+  std::thread T(RssThread);
   T.detach();
 }
 
@@ -358,11 +435,13 @@ int MinimizeCrashInputInternalStep(Fuzzer *F, InputCorpus *Corpus) {
 int FuzzerDriver(int *argc, char ***argv, UserCallback Callback) {
   using namespace fuzzer;
   assert(argc && argv && "Argument pointers cannot be nullptr");
-  EF = new ExternalFunctions();
+  if (!EF)
+    EF = new ExternalFunctions();
   if (EF->LLVMFuzzerInitialize)
     EF->LLVMFuzzerInitialize(argc, argv);
   const std::vector<std::string> Args(*argv, *argv + *argc);
   assert(!Args.empty());
+  delete ProgName;
   ProgName = new std::string(Args[0]);
   ParseFlags(Args);
   if (Flags.help) {
@@ -417,6 +496,16 @@ int FuzzerDriver(int *argc, char ***argv, UserCallback Callback) {
   if (!Inputs->empty() && !Flags.minimize_crash_internal_step)
     Options.OutputCorpus = (*Inputs)[0];
   Options.ReportSlowUnits = Flags.report_slow_units;
+  Options.SyncCorpus = CorpusToShare;
+  if (!Options.SyncCorpus && Flags.shared_corpus)
+    Options.SyncCorpus = JoinSharedCorpusFile(Flags.shared_corpus);
+  Options.Store = StoreToUse;
+  Options.ForkServerBatch = ForkServerBatch;
+  if (Flags.fork_server && !Options.ForkServerBatch)
+    Options.ForkServerBatch = std::max(Flags.fork_server_batch, 1);
+  Options.ForkChildStart = ForkChildStart;
+  Options.ForkChildExit = ForkChildExit;
+  Options.ForkShouldStop = ForkShouldStop;
   if (Flags.artifact_prefix)
     Options.ArtifactPrefix = Flags.artifact_prefix;
   if (Flags.exact_artifact_path)
@@ -433,6 +522,7 @@ int FuzzerDriver(int *argc, char ***argv, UserCallback Callback) {
   Options.PrintNewCovPcs = Flags.print_pcs;
   Options.PrintFinalStats = Flags.print_final_stats;
   Options.PrintCorpusStats = Flags.print_corpus_stats;
+  Options.ValidateFeatureSet = Flags.validate_feature_set;
   Options.PrintCoverage = Flags.print_coverage;
   if (Flags.exit_on_src_pos)
     Options.ExitOnSrcPos = Flags.exit_on_src_pos;
@@ -449,14 +539,14 @@ int FuzzerDriver(int *argc, char ***argv, UserCallback Callback) {
 
   Random Rand(Seed);
   MutationDispatcher MD(Rand, Options);
-  InputCorpus Corpus(Options.OutputCorpus);
+  InputCorpus Corpus(Options.OutputCorpus, Options.ValidateFeatureSet);
   Fuzzer F(Callback, Corpus, MD, Options);
 
   for (auto &U: Dictionary)
     if (U.size() <= Word::GetMaxSize())
       MD.AddWordToManualDictionary(Word(U.data(), U.size()));
 
-  StartRssThread(&F, Flags.rss_limit_mb);
+  StartRssThread(Flags.rss_limit_mb);
 
   // Timer
   if (Flags.timeout > 0)
@@ -511,6 +601,8 @@ int FuzzerDriver(int *argc, char ***argv, UserCallback Callback) {
     ReadDirToVectorOfUnits(Inp.c_str(), &InitialCorpus, nullptr,
                            TemporaryMaxLen, /*ExitOnError=*/false);
   }
+  if (Options.Store)
+    Options.Store->ReadNewUnits(&InitialCorpus, TemporaryMaxLen);
 
   if (Options.MaxLen == 0) {
     size_t MaxLen = 0;
@@ -537,6 +629,31 @@ int FuzzerDriver(int *argc, char ***argv, UserCallback Callback) {
 	//  exit(0);  // Don't let F destroy itself.
 }
 
+void SetSharedCorpus(SharedCorpus *SC) { CorpusToShare = SC; }
+
+void SetCorpusStore(CorpusStore *CS) { StoreToUse = CS; }
+
+void SetForkServer(size_t Batch, void (*ChildStart)(), void (*ChildExit)(),
+                   bool (*ShouldStop)()) {
+  ForkServerBatch = Batch;
+  ForkChildStart = ChildStart;
+  ForkChildExit = ChildExit;
+  ForkShouldStop = ShouldStop;
+}
+
+void ResetFuzzerDriver() {
+  Fuzzer::StaticResetCallback();
+  CorpusToShare = nullptr;
+  StoreToUse = nullptr;
+  SetForkServer(0, nullptr, nullptr, nullptr);
+  CurrentRssLimitMb = 0;
+  RestoreSignalHandlers();
+  delete Inputs;
+  Inputs = nullptr;
+  delete ProgName;
+  ProgName = nullptr;
+}
+
 // Storage for global ExternalFunctions object.
 ExternalFunctions *EF = nullptr;
 
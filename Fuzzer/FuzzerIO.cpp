@@ -13,6 +13,8 @@
 #include <iterator>
 #include <fstream>
 #include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -84,6 +86,29 @@ void DeleteFile(const std::string &Path) {
   unlink(Path.c_str());
 }
 
+void *MapSharedFile(const std::string &Path, size_t *Size, bool Create) {
+  int Fd = Create ? open(Path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600)
+                  : open(Path.c_str(), O_RDWR);
+  if (Fd < 0)
+    return nullptr;
+  void *Mem = MAP_FAILED;
+  struct stat St;
+  if (Create && ftruncate(Fd, static_cast<off_t>(*Size)) == 0)
+    Mem = mmap(nullptr, *Size, PROT_READ | PROT_WRITE, MAP_SHARED, Fd, 0);
+  if (!Create && fstat(Fd, &St) == 0 && St.st_size > 0) {
+    *Size = static_cast<size_t>(St.st_size);
+    Mem = mmap(nullptr, *Size, PROT_READ | PROT_WRITE, MAP_SHARED, Fd, 0);
+  }
+  close(Fd);
+  if (Mem != MAP_FAILED)
+    return Mem;
+  if (Create)
+    unlink(Path.c_str());
+  return nullptr;
+}
+
+void UnmapSharedFile(void *Mem, size_t Size) { munmap(Mem, Size); }
+
 std::string FileToString(const std::string &Path) {
   std::ifstream T(Path);
   return std::string((std::istreambuf_iterator<char>(T)),
@@ -29,6 +29,13 @@ namespace fuzzer {
 
 using namespace std::chrono;
 
+struct ForkServerState;
+
+// Runs all inputs on one thread: the coverage (TPC), the corpus and the
+// Fuzzer itself are process-wide. To use more cores, run more processes
+// and let them exchange units through a SharedCorpus (see SetSharedCorpus),
+// or fork children that share the parent's memory copy-on-write (see
+// SetForkServer).
 class Fuzzer {
 public:
 
@@ -59,7 +66,10 @@ public:
   void MinimizeCrashLoop(const Unit &U);
   void ShuffleAndMinimize(UnitVector *V);
   void InitializeTraceState();
+  static void ResetTraceState();
   void RereadOutputCorpus(size_t MaxSize);
+  // Runs the units other processes published to Options.SyncCorpus.
+  void ReadSharedCorpus(size_t MaxSize);
 
   size_t secondsSinceProcessStartUp() {
     return duration_cast<seconds>(system_clock::now() - ProcessStartTime)
@@ -82,6 +92,14 @@ public:
   static void StaticAlarmCallback();
   static void StaticCrashSignalCallback();
   static void StaticInterruptCallback();
+  static void StaticRssLimitCallback();
+  // Saves the current unit as <Prefix>-<sha1> without stopping, for
+  // findings that are not crashes.
+  static void StaticErrorCallback(const char *Prefix);
+  // Forgets the current Fuzzer so that a new one can be created in this
+  // process. Safe to call even if the Fuzzer's frame was unwound without
+  // running its destructor (e.g. by a longjmp out of the user callback).
+  static void StaticResetCallback();
 
   void ExecuteCallback(const uint8_t *Data, size_t Size);
   size_t RunOne(const uint8_t *Data, size_t Size);
@@ -109,9 +127,13 @@ private:
   void CrashCallback();
   void InterruptCallback();
   void MutateAndTestOne();
-  void ReportNewCoverage(InputInfo *II, const Unit &U);
+  void ReportNewCoverage(size_t BaseIdx, const Unit &U, size_t NumFeatures);
+  size_t ReadUnitsFrom(SharedCorpus *SC, uint32_t Id, uint64_t *Cursor,
+                       size_t MaxSize, bool FromChild = false);
+  bool ForkServerLoop();
+  void ForkServerChild();
   size_t RunOne(const Unit &U) { return RunOne(U.data(), U.size()); }
-  void WriteToOutputCorpus(const Unit &U);
+  void WriteToOutputCorpus(const Unit &U, size_t NumFeatures = 0);
   void WriteUnitToFileWithPrefix(const Unit &U, const char *Prefix);
   void PrintStats(const char *Where, const char *End = "\n", size_t Units = 0);
   void PrintStatusForNewUnit(const Unit &U);
@@ -141,6 +163,12 @@ private:
   void AllocateCurrentUnitData();
   uint8_t *CurrentUnitData = nullptr;
   std::atomic<size_t> CurrentUnitSize;
+  // Where the callback gets its copy of the input, see CopyToGuardedInput.
+  uint8_t *CopyToGuardedInput(const uint8_t *Data, size_t Size);
+  void FreeGuardedInput();
+  uint8_t *GuardedInput = nullptr;
+  size_t GuardedInputSize = 0;  // Usable bytes, not counting the guard page.
+  bool GuardedInputIsMapped = false;
   uint8_t BaseSha1[kSHA1NumBytes];  // Checksum of the base unit.
 
   size_t TotalNumberOfRuns = 0;
@@ -158,6 +186,13 @@ private:
   system_clock::time_point UnitStartTime, UnitStopTime;
   long TimeOfLongestUnitInSeconds = 0;
   long EpochOfLastReadOfOutputCorpus = 0;
+  uint32_t SyncCorpusId = 0;
+  uint64_t SyncCorpusCursor = 0;
+
+  // Set in fork server children, see ForkServerLoop.
+  ForkServerState *ForkState = nullptr;
+  SharedCorpus *ForkRing = nullptr;
+  uint32_t ForkRingId = 0;
 
   // Maximum recorded coverage.
   Coverage MaxCoverage;
@@ -14,11 +14,17 @@
 #include "FuzzerMutate.h"
 #include "FuzzerTracePC.h"
 #include "FuzzerRandom.h"
+#include "FuzzerSharedCorpus.h"
 
 #include <algorithm>
 #include <cstring>
+#include <errno.h>
 #include <set>
 #include <memory>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #if defined(__has_include)
 #if __has_include(<sanitizer / coverage_interface.h>)
@@ -42,6 +48,54 @@ static const size_t kMaxUnitSizeToPrint = 256;
 
 thread_local bool Fuzzer::IsMyThread;
 
+// The part of a fork server's state that its children write to.
+// Followed in memory by the input being run, the PCs of the guards the
+// children have covered and a ring of new units.
+struct ForkServerState {
+  static const size_t kNumRingSlots = 1024;
+
+  static size_t SizeFor(size_t MaxLen, size_t NumPCs) {
+    return RingOffset(MaxLen, NumPCs) +
+           SharedCorpus::SizeFor(kNumRingSlots, MaxLen);
+  }
+  static size_t PCsOffset(size_t MaxLen) {
+    return (sizeof(ForkServerState) + MaxLen + 7) & ~static_cast<size_t>(7);
+  }
+  static size_t RingOffset(size_t MaxLen, size_t NumPCs) {
+    return PCsOffset(MaxLen) + NumPCs * sizeof(uintptr_t);
+  }
+
+  ForkServerState(size_t MaxLen, size_t NumPCs)
+      : NumRuns(0), UnitSize(0), MaxLen(MaxLen), NumPCs(NumPCs) {}
+
+  void StartUnit(const uint8_t *Data, size_t Size) {
+    memcpy(UnitData(), Data, Size);
+    UnitSize = Size;
+    NumRuns++;
+  }
+  uint8_t *UnitData() { return reinterpret_cast<uint8_t *>(this + 1); }
+  uintptr_t *PCs() {
+    return reinterpret_cast<uintptr_t *>(reinterpret_cast<uint8_t *>(this) +
+                                         PCsOffset(MaxLen));
+  }
+
+  // Called by a child with the features a unit it adds has added: records
+  // the PCs of the guards whose counters they came from, so that the
+  // parent's PC coverage keeps up without running the unit.
+  void RecordPCs(const std::vector<uint32_t> &Features) {
+    for (uint32_t Feature : Features) {
+      size_t Guard = Feature / 8;
+      if (Feature < TPC.FirstValueProfileFeature() && Guard < NumPCs)
+        PCs()[Guard] = TPC.GetPC(Guard);
+    }
+  }
+
+  std::atomic<size_t> NumRuns;  // Inputs started by the current child.
+  std::atomic<size_t> UnitSize;  // Size of the one it is running.
+  const size_t MaxLen;
+  const size_t NumPCs;
+};
+
 static void MissingExternalApiFunction(const char *FnName) {
   Printf("ERROR: %s is not defined. Exiting.\n"
          "Did you use -fsanitize-coverage=... to build your code?\n",
@@ -175,11 +229,24 @@ Fuzzer::Fuzzer(UserCallback CB, InputCorpus &Corpus, MutationDispatcher &MD,
     TPC.PrintModuleInfo();
   if (!Options.OutputCorpus.empty() && Options.ReloadIntervalSec)
     EpochOfLastReadOfOutputCorpus = GetEpoch(Options.OutputCorpus);
+  if (Options.SyncCorpus)
+    SyncCorpusId = Options.SyncCorpus->Join();
   MaxInputLen = MaxMutationLen = Options.MaxLen;
   AllocateCurrentUnitData();
 }
 
-Fuzzer::~Fuzzer() { }
+Fuzzer::~Fuzzer() {
+  StaticResetCallback();
+  delete[] CurrentUnitData;
+  FreeGuardedInput();
+}
+
+void Fuzzer::StaticResetCallback() {
+  if (!F) return;
+  ResetTraceState();
+  TPC.ResetCoverage();
+  F = nullptr;
+}
 
 void Fuzzer::AllocateCurrentUnitData() {
   if (CurrentUnitData || MaxInputLen == 0) return;
@@ -196,6 +263,11 @@ void Fuzzer::StaticDeathCallback() {
   F->DeathCallback();
 }
 
+void Fuzzer::StaticErrorCallback(const char *Prefix) {
+  if (!F) return;  // Not running under the fuzzer.
+  F->DumpCurrentUnit((std::string(Prefix) + "-").c_str());
+}
+
 static void WarnOnUnsuccessfullMerge(bool DoWarn) {
   if (!DoWarn) return;
   Printf(
@@ -232,7 +304,7 @@ void Fuzzer::DeathCallback() {
 }
 
 void Fuzzer::StaticAlarmCallback() {
-  assert(F);
+  if (!F) return;  // Between two fuzzing sessions.
   F->AlarmCallback();
 }
 
@@ -246,6 +318,11 @@ void Fuzzer::StaticInterruptCallback() {
   F->InterruptCallback();
 }
 
+void Fuzzer::StaticRssLimitCallback() {
+  if (!F) return;
+  F->RssLimitCallback();
+}
+
 void Fuzzer::CrashCallback() {
   Printf("==%d== ERROR: libFuzzer: deadly signal\n", GetPid());
   if (EF->__sanitizer_print_stack_trace)
@@ -406,11 +483,16 @@ void Fuzzer::CheckExitOnSrcPosOrItem() {
 }
 
 void Fuzzer::RereadOutputCorpus(size_t MaxSize) {
-  if (Options.OutputCorpus.empty() || !Options.ReloadIntervalSec) return;
+  if (!Options.ReloadIntervalSec) return;
   std::vector<Unit> AdditionalCorpus;
-  ReadDirToVectorOfUnits(Options.OutputCorpus.c_str(), &AdditionalCorpus,
-                         &EpochOfLastReadOfOutputCorpus, MaxSize,
-                         /*ExitOnError*/ false);
+  if (Options.Store)
+    Options.Store->ReadNewUnits(&AdditionalCorpus, MaxSize);
+  else if (!Options.OutputCorpus.empty())
+    ReadDirToVectorOfUnits(Options.OutputCorpus.c_str(), &AdditionalCorpus,
+                           &EpochOfLastReadOfOutputCorpus, MaxSize,
+                           /*ExitOnError*/ false);
+  else
+    return;
   if (Options.Verbosity >= 2)
     Printf("Reload: read %zd new units.\n", AdditionalCorpus.size());
   bool Reloaded = false;
@@ -429,6 +511,55 @@ void Fuzzer::RereadOutputCorpus(size_t MaxSize) {
     PrintStats("RELOAD");
 }
 
+void Fuzzer::ReadSharedCorpus(size_t MaxSize) {
+  if (!Options.SyncCorpus) return;
+  if (ReadUnitsFrom(Options.SyncCorpus, SyncCorpusId, &SyncCorpusCursor,
+                    MaxSize))
+    PrintStats("SYNC  ");
+}
+
+// Runs the units others published to SC since *Cursor and adds the ones
+// that add coverage here to the corpus. Units from our own fork children
+// (FromChild) are also saved, and when the features they come with are the
+// whole story, i.e. with trace-pc-guard, those are taken as they are
+// instead of running the unit again. Returns the number added.
+size_t Fuzzer::ReadUnitsFrom(SharedCorpus *SC, uint32_t Id, uint64_t *Cursor,
+                             size_t MaxSize, bool FromChild) {
+  size_t NumAdded = 0;
+  bool TakeFeatures = FromChild && TPC.UsingTracePcGuard();
+  SC->Fetch(
+      Id, Cursor,
+      [&](Unit &U, const uint32_t *Features, size_t NumFeatures) {
+        // The unit is only worth running if it may add something here.
+        if (NumFeatures && !Options.Shrink &&
+            Corpus.HasFeatures(Features, NumFeatures))
+          return;
+        // The features are those of the whole unit, not of a prefix.
+        bool Truncated = U.size() > MaxSize;
+        if (Truncated)
+          U.resize(MaxSize);
+        if (Corpus.HasUnit(U))
+          return;
+        size_t NumNewFeatures = 0;
+        if (TakeFeatures && NumFeatures && !Truncated) {
+          Corpus.ClearAddedFeatures();
+          NumNewFeatures = Corpus.AddFeatures(
+              Features, NumFeatures, static_cast<uint32_t>(U.size()),
+              Options.Shrink);
+        } else {
+          NumNewFeatures = RunOne(U);
+        }
+        if (NumNewFeatures) {
+          CheckExitOnSrcPosOrItem();
+          Corpus.AddToCorpus(U, NumNewFeatures);
+          if (FromChild)
+            WriteToOutputCorpus(U, NumNewFeatures);
+          NumAdded++;
+        }
+      });
+  return NumAdded;
+}
+
 void Fuzzer::ShuffleCorpus(UnitVector *V) {
   std::random_shuffle(V->begin(), V->end(), MD.GetRand());
   if (Options.PreferSmall)
@@ -472,6 +603,7 @@ size_t Fuzzer::RunOne(const uint8_t *Data, size_t Size) {
   ExecuteCallback(Data, Size);
 
   size_t Res = 0;
+  Corpus.ClearAddedFeatures();
   if (size_t NumFeatures = TPC.FinalizeTrace(&Corpus, Size, Options.Shrink))
     Res = NumFeatures;
 
@@ -504,13 +636,14 @@ size_t Fuzzer::GetCurrentUnitInFuzzingThead(const uint8_t **Data) const {
 
 void Fuzzer::ExecuteCallback(const uint8_t *Data, size_t Size) {
   assert(InFuzzingThread());
-  // We copy the contents of Unit into a separate heap buffer
+  // We copy the contents of Unit into a separate buffer
   // so that we reliably find buffer overflows in it.
-  uint8_t *DataCopy = new uint8_t[Size];
-  memcpy(DataCopy, Data, Size);
+  uint8_t *DataCopy = CopyToGuardedInput(Data, Size);
   if (CurrentUnitData && CurrentUnitData != Data)
     memcpy(CurrentUnitData, Data, Size);
   CurrentUnitSize = Size;
+  if (ForkState)
+    ForkState->StartUnit(Data, Size);
   AllocTracer.Start(Options.TraceMalloc);
   UnitStartTime = system_clock::now();
   ResetCounters();  // Reset coverage right before the callback.
@@ -521,12 +654,58 @@ void Fuzzer::ExecuteCallback(const uint8_t *Data, size_t Size) {
   assert(Res == 0);
   HasMoreMallocsThanFrees = AllocTracer.Stop();
   CurrentUnitSize = 0;
-  delete[] DataCopy;
 }
 
-void Fuzzer::WriteToOutputCorpus(const Unit &U) {
+// Copies the input to the end of a buffer that is followed by a PROT_NONE
+// page, so that reading or writing past the input faults right away, with
+// or without ASan, and without a heap allocation per execution. The buffer
+// is only remapped when an input doesn't fit. (Unlike an ASan heap copy
+// this doesn't catch accesses before the start of the input.)
+uint8_t *Fuzzer::CopyToGuardedInput(const uint8_t *Data, size_t Size) {
+  if (!GuardedInput || Size > GuardedInputSize) {
+    FreeGuardedInput();
+    size_t PageSize = sysconf(_SC_PAGESIZE);
+    size_t Len = std::max(std::max(Size, MaxInputLen), (size_t)1);
+    Len = (Len + PageSize - 1) / PageSize * PageSize;
+    void *Mem = mmap(nullptr, Len + PageSize, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (Mem != MAP_FAILED &&
+        mprotect(static_cast<uint8_t *>(Mem) + Len, PageSize, PROT_NONE)) {
+      munmap(Mem, Len + PageSize);
+      Mem = MAP_FAILED;
+    }
+    if (Mem == MAP_FAILED) {
+      Printf("WARNING: could not map a guarded input buffer (%d)\n", errno);
+      GuardedInput = new uint8_t[Len];
+      GuardedInputIsMapped = false;
+    } else {
+      GuardedInput = static_cast<uint8_t *>(Mem);
+      GuardedInputIsMapped = true;
+    }
+    GuardedInputSize = Len;
+  }
+  uint8_t *Copy = GuardedInput + GuardedInputSize - Size;
+  memcpy(Copy, Data, Size);
+  return Copy;
+}
+
+void Fuzzer::FreeGuardedInput() {
+  if (!GuardedInput) return;
+  if (GuardedInputIsMapped)
+    munmap(GuardedInput, GuardedInputSize + sysconf(_SC_PAGESIZE));
+  else
+    delete[] GuardedInput;
+  GuardedInput = nullptr;
+  GuardedInputSize = 0;
+}
+
+void Fuzzer::WriteToOutputCorpus(const Unit &U, size_t NumFeatures) {
   if (Options.OnlyASCII)
     assert(IsASCII(U));
+  if (Options.Store) {
+    Options.Store->WriteUnit(U, Hash(U), NumFeatures);
+    return;
+  }
   if (Options.OutputCorpus.empty())
     return;
   std::string Path = DirPlusFile(Options.OutputCorpus, Hash(U));
@@ -559,11 +738,23 @@ void Fuzzer::PrintStatusForNewUnit(const Unit &U) {
   }
 }
 
-void Fuzzer::ReportNewCoverage(InputInfo *II, const Unit &U) {
-  II->NumSuccessfullMutations++;
+void Fuzzer::ReportNewCoverage(size_t BaseIdx, const Unit &U,
+                               size_t NumFeatures) {
+  Corpus.RecordSuccessfulMutation(BaseIdx);
   MD.RecordSuccessfulMutationSequence();
   PrintStatusForNewUnit(U);
-  WriteToOutputCorpus(U);
+  WriteToOutputCorpus(U, NumFeatures);
+  if (Options.SyncCorpus) {
+    auto &Features = Corpus.GetAddedFeatures();
+    Options.SyncCorpus->Publish(SyncCorpusId, U.data(), U.size(),
+                                Features.data(), Features.size());
+  }
+  if (ForkRing) {
+    auto &Features = Corpus.GetAddedFeatures();
+    ForkState->RecordPCs(Features);
+    ForkRing->Publish(ForkRingId, U.data(), U.size(), Features.data(),
+                      Features.size());
+  }
   NumberOfNewUnitsAdded++;
   TPC.PrintNewPCs();
 }
@@ -680,9 +871,10 @@ void Fuzzer::TryDetectingAMemoryLeak(const uint8_t *Data, size_t Size,
 void Fuzzer::MutateAndTestOne() {
   MD.StartMutationSequence();
 
-  auto &II = Corpus.ChooseUnitToMutate(MD.GetRand());
-  const auto &U = II.U;
-  memcpy(BaseSha1, II.Sha1, sizeof(BaseSha1));
+  size_t BaseIdx = Corpus.ChooseUnitIdxToMutate(MD.GetRand());
+  UnitRef U = Corpus[BaseIdx];
+  assert(!U.empty());
+  memcpy(BaseSha1, Corpus.Sha1(BaseIdx), sizeof(BaseSha1));
   assert(CurrentUnitData);
   size_t Size = U.size();
   assert(Size <= MaxInputLen && "Oversized Unit");
@@ -700,11 +892,12 @@ void Fuzzer::MutateAndTestOne() {
     Size = NewSize;
     if (i == 0)
       StartTraceRecording();
-    II.NumExecutedMutations++;
+    Corpus.RecordExecutedMutation(BaseIdx);
     if (size_t NumFeatures = RunOne(CurrentUnitData, Size)) {
-      Corpus.AddToCorpus({CurrentUnitData, CurrentUnitData + Size}, NumFeatures,
+      Corpus.AddToCorpus(CurrentUnitData, Size, NumFeatures,
                          /*MayDeleteFile=*/true);
-      ReportNewCoverage(&II, {CurrentUnitData, CurrentUnitData + Size});
+      ReportNewCoverage(BaseIdx, {CurrentUnitData, CurrentUnitData + Size},
+                        NumFeatures);
       CheckExitOnSrcPosOrItem();
     }
     StopTraceRecording();
@@ -723,6 +916,8 @@ void Fuzzer::Loop() {
   system_clock::time_point LastCorpusReload = system_clock::now();
   if (Options.DoCrossOver)
     MD.SetCorpus(&Corpus);
+  if (Options.ForkServerBatch && ForkServerLoop())
+    return;
   while (true) {
     auto Now = system_clock::now();
     if (duration_cast<seconds>(Now - LastCorpusReload).count() >=
@@ -730,6 +925,7 @@ void Fuzzer::Loop() {
       RereadOutputCorpus(MaxInputLen);
       LastCorpusReload = system_clock::now();
     }
+    ReadSharedCorpus(MaxInputLen);
     if (TotalNumberOfRuns >= Options.MaxNumberOfRuns)
       break;
     if (TimedOut()) break;
@@ -741,6 +937,138 @@ void Fuzzer::Loop() {
   MD.PrintRecommendedDictionary();
 }
 
+// Fork server mode: this process keeps the corpus and the coverage and
+// forks children that run the fuzzing loop for ForkServerBatch inputs each.
+// A child that crashes or exits early (e.g. on a postgres FATAL) costs only
+// the input it was running, which we write out as a crash, and the next
+// child starts from everything found so far. Children hand the units they
+// add back through a ring together with the features they added, which we
+// merge into our own feature set without running the target here, and
+// leave the PCs those features came from in the shared state; only
+// units whose features did not fit in the ring, or coverage other than
+// trace-pc-guard, are run again. Units other processes add to the output
+// corpus or the shared corpus are run here, as they would be without the
+// fork server. While a child runs we poll Options.ForkShouldStop, if set,
+// so that the host can still be interrupted. Returns false if the fork
+// server could not be set up.
+bool Fuzzer::ForkServerLoop() {
+  size_t NumPCs = TPC.GetNumPCs();
+  size_t MapSize = ForkServerState::SizeFor(MaxInputLen, NumPCs);
+  void *Mem = mmap(nullptr, MapSize, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANON, -1, 0);
+  if (Mem == MAP_FAILED) {
+    Printf("WARNING: fork server: mmap failed (%d), running in-process\n",
+           errno);
+    return false;
+  }
+  ForkServerState *State = new (Mem) ForkServerState(MaxInputLen, NumPCs);
+  SharedCorpus *Ring = SharedCorpus::Create(
+      reinterpret_cast<uint8_t *>(Mem) +
+          ForkServerState::RingOffset(MaxInputLen, NumPCs),
+      ForkServerState::kNumRingSlots, MaxInputLen);
+  uint32_t RingId = Ring->Join();
+  uint64_t RingCursor = 0;
+  size_t NumChildren = 0, NumDeadChildren = 0;
+  system_clock::time_point LastCorpusReload = system_clock::now();
+  bool Stop = false;
+
+  while (!Stop && TotalNumberOfRuns < Options.MaxNumberOfRuns &&
+         !TimedOut()) {
+    State->NumRuns = 0;
+    State->UnitSize = 0;
+    // Otherwise every child would try the very same mutations.
+    unsigned ChildSeed = static_cast<unsigned>(MD.GetRand().Rand());
+    pid_t Pid = fork();
+    if (Pid < 0) {
+      Printf("WARNING: fork server: fork failed (%d)\n", errno);
+      break;
+    }
+    if (Pid == 0) {
+      ForkState = State;
+      ForkRing = Ring;
+      ForkRingId = Ring->Join();
+      MD.GetRand().Get_mt19937().seed(ChildSeed);
+      ForkServerChild();  // Does not return.
+    }
+    int Status = 0;
+    if (!Options.ForkShouldStop) {
+      while (waitpid(Pid, &Status, 0) < 0 && errno == EINTR)
+        ;
+    } else {
+      // Back off up to 1ms so that short-lived children are not held up.
+      for (useconds_t Sleep = 100; waitpid(Pid, &Status, WNOHANG) == 0;
+           Sleep = std::min(Sleep * 2, static_cast<useconds_t>(1000))) {
+        if (!Stop && Options.ForkShouldStop()) {
+          Stop = true;
+          kill(Pid, SIGINT);
+        }
+        usleep(Sleep);
+      }
+      Stop = Stop || Options.ForkShouldStop();
+    }
+    NumChildren++;
+    TotalNumberOfRuns += State->NumRuns;
+    // A child that was stopped, or stopped us, did not crash.
+    if (!Stop && (!WIFEXITED(Status) || WEXITSTATUS(Status) != 0)) {
+      NumDeadChildren++;
+      Printf("==%d== fork server: child %d %s %d after %zd inputs\n",
+             GetPid(), Pid,
+             WIFSIGNALED(Status) ? "killed by signal" : "exited with code",
+             WIFSIGNALED(Status) ? WTERMSIG(Status) : WEXITSTATUS(Status),
+             State->NumRuns.load());
+      Unit U(State->UnitData(), State->UnitData() + State->UnitSize);
+      if (!U.empty()) {
+        if (U.size() <= kMaxUnitSizeToPrint) {
+          PrintHexArray(U.data(), U.size(), "\n");
+          PrintASCII(U.data(), U.size(), "\n");
+        }
+        WriteUnitToFileWithPrefix(U, "crash-");
+      }
+    }
+    // Before the units, so that -exit_on_src_pos sees their PCs.
+    TPC.MergePCs(State->PCs(), NumPCs);
+    if (ReadUnitsFrom(Ring, RingId, &RingCursor, MaxInputLen,
+                      /*FromChild=*/true))
+      PrintStats("FORK  ");
+    if (Stop)
+      break;
+    if (duration_cast<seconds>(system_clock::now() - LastCorpusReload)
+            .count() >= Options.ReloadIntervalSec) {
+      RereadOutputCorpus(MaxInputLen);
+      LastCorpusReload = system_clock::now();
+    }
+    ReadSharedCorpus(MaxInputLen);
+  }
+
+  PrintStats("DONE  ", "\n");
+  Printf("stat::fork_server_children:     %zd\n", NumChildren);
+  Printf("stat::fork_server_dead_children: %zd\n", NumDeadChildren);
+  munmap(Mem, MapSize);
+  return true;
+}
+
+void Fuzzer::ForkServerChild() {
+  // Put back the host's signal handlers so that a crash kills the child
+  // right away; the parent knows which input it was running.
+  RestoreSignalHandlers();
+  // The parent saves what we find, the store may not be usable from here.
+  Options.Store = nullptr;
+  if (Options.ForkChildStart)
+    Options.ForkChildStart();
+  size_t FirstRun = TotalNumberOfRuns;
+  // Stop before the ring wraps around so the parent gets every unit we add.
+  uint64_t FirstSlot = ForkRing->Tail();
+  while (TotalNumberOfRuns - FirstRun < Options.ForkServerBatch &&
+         ForkRing->Tail() - FirstSlot < ForkServerState::kNumRingSlots &&
+         TotalNumberOfRuns < Options.MaxNumberOfRuns && !TimedOut()) {
+    ReadSharedCorpus(MaxInputLen);
+    MutateAndTestOne();
+  }
+  if (Options.ForkChildExit)
+    Options.ForkChildExit();
+  _Exit(0);
+}
+
 void Fuzzer::MinimizeCrashLoop(const Unit &U) {
   if (U.size() <= 2) return;
   while (!TimedOut() && TotalNumberOfRuns < Options.MaxNumberOfRuns) {
@@ -79,7 +79,7 @@ size_t MutationDispatcher::Mutate_CustomCrossOver(uint8_t *Data, size_t Size,
   if (!Corpus || Corpus->size() < 2 || Size == 0)
     return 0;
   size_t Idx = Rand(Corpus->size());
-  const Unit &Other = (*Corpus)[Idx];
+  UnitRef Other = (*Corpus)[Idx];
   if (Other.empty())
     return 0;
   MutateInPlaceHere.resize(MaxSize);
@@ -403,7 +403,7 @@ size_t MutationDispatcher::Mutate_CrossOver(uint8_t *Data, size_t Size,
   if (Size > MaxSize) return 0;
   if (!Corpus || Corpus->size() < 2 || Size == 0) return 0;
   size_t Idx = Rand(Corpus->size());
-  const Unit &O = (*Corpus)[Idx];
+  UnitRef O = (*Corpus)[Idx];
   if (O.empty()) return 0;
   MutateInPlaceHere.resize(MaxSize);
   auto &U = MutateInPlaceHere;
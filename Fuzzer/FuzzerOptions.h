@@ -50,9 +50,16 @@ struct FuzzingOptions {
   bool PrintNewCovPcs = false;
   bool PrintFinalStats = false;
   bool PrintCorpusStats = false;
+  bool ValidateFeatureSet = false;
   bool PrintCoverage = false;
   bool DetectLeaks = true;
   int  TraceMalloc = 0;
+  SharedCorpus *SyncCorpus = nullptr;  // Not owned.
+  CorpusStore *Store = nullptr;  // Not owned; replaces OutputCorpus.
+  size_t ForkServerBatch = 0;  // Inputs per fork server child; 0 is off.
+  void (*ForkChildStart)() = nullptr;
+  void (*ForkChildExit)() = nullptr;
+  bool (*ForkShouldStop)() = nullptr;
 };
 
 }  // namespace fuzzer
@@ -0,0 +1,153 @@
+//===- FuzzerSharedCorpus.h - Internal header for the Fuzzer ----*- C++ -* ===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+// fuzzer::SharedCorpus
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_FUZZER_SHARED_CORPUS_H
+#define LLVM_FUZZER_SHARED_CORPUS_H
+
+#include <atomic>
+#include <new>
+#include <string.h>
+
+#include "FuzzerDefs.h"
+
+namespace fuzzer {
+
+// A ring of recently added units that lives in memory shared by several
+// fuzzing processes (e.g. a postgres DSM segment or a MAP_SHARED mapping).
+// Every process publishes the units it adds to its corpus, together with the
+// features they added, and pulls the units published by the others.
+//
+// The object contains no pointers, so each process may map it at a different
+// address. Writers claim a sequence number and stamp their slot with a
+// version before and after copying the unit in; readers copy the unit out
+// and re-check the version, dropping it if the slot was reused meanwhile.
+// A reader that falls more than NumSlots units behind loses the oldest ones.
+class SharedCorpus {
+ public:
+  static const size_t kMaxFeaturesPerUnit = 32;
+
+  static size_t SizeFor(size_t NumSlots, size_t MaxUnitSize) {
+    return sizeof(SharedCorpus) + NumSlots * SlotSizeFor(MaxUnitSize);
+  }
+
+  // Initializes a SharedCorpus in Mem, which must hold SizeFor() bytes.
+  // If MemIsZeroed (e.g. a new mapping) the slots are not cleared again,
+  // which would touch every page up front.
+  static SharedCorpus *Create(void *Mem, size_t NumSlots, size_t MaxUnitSize,
+                              bool MemIsZeroed = false) {
+    auto SC = new (Mem) SharedCorpus(NumSlots, MaxUnitSize);
+    if (!MemIsZeroed)
+      memset(reinterpret_cast<uint8_t *>(SC + 1), 0, NumSlots * SC->SlotSize);
+    return SC;
+  }
+
+  // Returns the SharedCorpus that another process created in Mem, or
+  // nullptr if the MemSize bytes there do not hold one.
+  static SharedCorpus *Attach(void *Mem, size_t MemSize) {
+    auto SC = reinterpret_cast<SharedCorpus *>(Mem);
+    if (MemSize < sizeof(SharedCorpus) || !SC->NumSlots ||
+        SC->SlotSize != SlotSizeFor(SC->UnitSize) ||
+        SizeFor(SC->NumSlots, SC->UnitSize) > MemSize)
+      return nullptr;
+    return SC;
+  }
+
+  size_t MaxUnitSize() const { return UnitSize; }
+
+  // Returns an id that is unique among the processes using this corpus.
+  uint32_t Join() { return NumClients++; }
+
+  // Returns the sequence number of the next unit to be published.
+  uint64_t Tail() const { return Head.load(std::memory_order_acquire); }
+
+  // Makes U visible to the other processes. Features are the (already
+  // reduced) feature indices U added; pass none if they are not known.
+  // Returns false if U is too large to be shared.
+  bool Publish(uint32_t Origin, const uint8_t *Data, size_t Size,
+               const uint32_t *Features, size_t NumFeatures) {
+    if (Size > UnitSize) return false;
+    if (NumFeatures > kMaxFeaturesPerUnit) NumFeatures = 0;
+    uint64_t Seq = Head.fetch_add(1, std::memory_order_acq_rel);
+    Slot *S = GetSlot(Seq);
+    S->Version.store(2 * Seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    S->Origin = Origin;
+    S->Size = static_cast<uint32_t>(Size);
+    S->NumFeatures = static_cast<uint32_t>(NumFeatures);
+    memcpy(S->Features, Features, NumFeatures * sizeof(Features[0]));
+    memcpy(S->Data(), Data, Size);
+    S->Version.store(2 * Seq + 2, std::memory_order_release);
+    return true;
+  }
+
+  // Calls CB(U, Features, NumFeatures) for every unit published by a
+  // process other than Origin since *Cursor, and advances *Cursor.
+  // Stops early at a slot that is still being written.
+  template <class Callback>
+  size_t Fetch(uint32_t Origin, uint64_t *Cursor, Callback CB) {
+    uint64_t End = Tail();
+    uint64_t Seq = *Cursor;
+    if (End - Seq > NumSlots) Seq = End - NumSlots;
+    size_t Res = 0;
+    uint32_t Features[kMaxFeaturesPerUnit];
+    for (; Seq < End; Seq++) {
+      Slot *S = GetSlot(Seq);
+      uint64_t Version = S->Version.load(std::memory_order_acquire);
+      if (Version < 2 * Seq + 2) break;  // Not written yet.
+      if (Version > 2 * Seq + 2) continue;  // Already reused.
+      uint32_t From = S->Origin;
+      size_t Size = Min<size_t>(S->Size, UnitSize);
+      size_t NumFeatures = Min<size_t>(S->NumFeatures, kMaxFeaturesPerUnit);
+      Unit U(S->Data(), S->Data() + Size);
+      memcpy(Features, S->Features, NumFeatures * sizeof(Features[0]));
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (S->Version.load(std::memory_order_relaxed) != Version) continue;
+      if (From == Origin || U.empty()) continue;
+      CB(U, Features, NumFeatures);
+      Res++;
+    }
+    *Cursor = Seq;
+    return Res;
+  }
+
+ private:
+  struct Slot {
+    std::atomic<uint64_t> Version;
+    uint32_t Origin;
+    uint32_t Size;
+    uint32_t NumFeatures;
+    uint32_t Features[kMaxFeaturesPerUnit];
+    uint8_t *Data() { return reinterpret_cast<uint8_t *>(this + 1); }
+  };
+
+  static size_t SlotSizeFor(size_t MaxUnitSize) {
+    return (sizeof(Slot) + MaxUnitSize + 7) & ~static_cast<size_t>(7);
+  }
+
+  SharedCorpus(size_t NumSlots, size_t MaxUnitSize)
+      : Head(0), NumClients(0), NumSlots(NumSlots), UnitSize(MaxUnitSize),
+        SlotSize(SlotSizeFor(MaxUnitSize)) {}
+
+  Slot *GetSlot(uint64_t Seq) {
+    uint8_t *Slots = reinterpret_cast<uint8_t *>(this + 1);
+    return reinterpret_cast<Slot *>(Slots + (Seq % NumSlots) * SlotSize);
+  }
+
+  std::atomic<uint64_t> Head;
+  std::atomic<uint32_t> NumClients;
+  size_t NumSlots;
+  size_t UnitSize;
+  size_t SlotSize;
+};
+
+}  // namespace fuzzer
+
+#endif  // LLVM_FUZZER_SHARED_CORPUS_H
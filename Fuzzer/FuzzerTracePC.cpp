@@ -15,6 +15,10 @@
 #include <map>
 #include <set>
 #include <sstream>
+#include <stdlib.h>
+#ifdef __x86_64
+#include <immintrin.h>
+#endif
 
 #include "FuzzerCorpus.h"
 #include "FuzzerDefs.h"
@@ -30,16 +34,39 @@ TracePC TPC;
 void TracePC::HandleTrace(uint32_t *Guard, uintptr_t PC) {
   uint32_t Idx = *Guard;
   if (!Idx) return;
-  PCs[Idx % kNumPCs] = PC;
-  Counters[Idx % kNumCounters]++;
+  // Only written the first time, so covered PCs can be counted as we go
+  // and hot edges don't store to the table over and over.
+  if (!PCs[Idx]) {
+    PCs[Idx] = PC;
+    NumCoveredPCs++;
+  }
+  if (!Counters[Idx]++) {
+    if (NumDirtyCounters < NumCounters)
+      DirtyCounters[NumDirtyCounters++] = Idx;
+    else
+      DirtyCountersOverflow = true;
+  }
 }
 
-size_t TracePC::GetTotalPCCoverage() {
-  size_t Res = 0;
-  for (size_t i = 1; i < GetNumPCs(); i++)
-    if (PCs[i])
-      Res++;
-  return Res;
+size_t TracePC::GetTotalPCCoverage() { return NumCoveredPCs; }
+
+void TracePC::MergePCs(const uintptr_t *OtherPCs, size_t N) {
+  N = Min(N, GetNumPCs());
+  for (size_t i = 1; i < N; i++)
+    if (!PCs[i] && OtherPCs[i]) {
+      PCs[i] = OtherPCs[i];
+      NumCoveredPCs++;
+    }
+}
+
+void TracePC::ResetCoverage() {
+  ResetMaps();
+  if (PCs)
+    memset(PCs, 0, GetNumPCs() * sizeof(PCs[0]));
+  NumCoveredPCs = 0;
+  NumCoveredPCsAtLastPrint = 0;
+  if (PrintedPCs)
+    PrintedPCs->clear();
 }
 
 void TracePC::HandleInit(uint32_t *Start, uint32_t *Stop) {
@@ -50,6 +77,41 @@ void TracePC::HandleInit(uint32_t *Start, uint32_t *Stop) {
   Modules[NumModules].Start = Start;
   Modules[NumModules].Stop = Stop;
   NumModules++;
+  if (NumGuards + 1 > NumCounters)
+    GrowGuardArrays(NumGuards + 1);
+}
+
+// Modules may be loaded while an input runs (e.g. a library the target
+// dlopens), so the counters and PCs collected so far are carried over.
+void TracePC::GrowGuardArrays(size_t MinNumCounters) {
+  size_t NewNumCounters = Max(2 * NumCounters, MinNumCounters);
+  NewNumCounters = (NewNumCounters + kCounterAlignment - 1) &
+                   ~(kCounterAlignment - 1);
+  void *NewCounters = nullptr;
+  if (posix_memalign(&NewCounters, kCounterAlignment, NewNumCounters)) {
+    Printf("ERROR: failed to allocate %zd coverage counters\n",
+           NewNumCounters);
+    abort();
+  }
+  memset(NewCounters, 0, NewNumCounters);
+  if (Counters)
+    memcpy(NewCounters, Counters, NumCounters);
+  uintptr_t *NewPCs = new uintptr_t[NewNumCounters]();
+  if (PCs)
+    memcpy(NewPCs, PCs, NumCounters * sizeof(PCs[0]));
+  uint32_t *NewDirtyCounters = new uint32_t[NewNumCounters];
+  if (DirtyCounters)
+    memcpy(NewDirtyCounters, DirtyCounters,
+           NumDirtyCounters * sizeof(DirtyCounters[0]));
+  free(Counters);
+  delete[] CounterFeatures;
+  delete[] PCs;
+  delete[] DirtyCounters;
+  Counters = static_cast<uint8_t *>(NewCounters);
+  CounterFeatures = new uint32_t[NewNumCounters];
+  PCs = NewPCs;
+  DirtyCounters = NewDirtyCounters;
+  NumCounters = NewNumCounters;
 }
 
 void TracePC::PrintModuleInfo() {
@@ -59,21 +121,12 @@ void TracePC::PrintModuleInfo() {
   Printf("\n");
 }
 
-size_t TracePC::FinalizeTrace(InputCorpus *C, size_t InputSize, bool Shrink) {
-  if (!UsingTracePcGuard()) return 0;
-  size_t Res = 0;
-  const size_t Step = 8;
-  assert(reinterpret_cast<uintptr_t>(Counters) % Step == 0);
-  size_t N = Min(kNumCounters, NumGuards + 1);
-  N = (N + Step - 1) & ~(Step - 1);  // Round up.
-  for (size_t Idx = 0; Idx < N; Idx += Step) {
-    uint64_t Bundle = *reinterpret_cast<uint64_t*>(&Counters[Idx]);
-    if (!Bundle) continue;
-    for (size_t i = Idx; i < Idx + Step; i++) {
-      uint8_t Counter = (Bundle >> (i * 8)) & 0xff;
-      if (!Counter) continue;
-      Counters[i] = 0;
-      unsigned Bit = 0;
+// Maps a counter value to one of 8 buckets:
+// 1, 2, 3, 4-7, 8-15, 16-31, 32-127, 128+.
+struct CounterBucketTable {
+  CounterBucketTable() {
+    for (unsigned Counter = 0; Counter < 256; Counter++) {
+      uint8_t Bit = 0;
       /**/ if (Counter >= 128) Bit = 7;
       else if (Counter >= 32) Bit = 6;
       else if (Counter >= 16) Bit = 5;
@@ -81,14 +134,123 @@ size_t TracePC::FinalizeTrace(InputCorpus *C, size_t InputSize, bool Shrink) {
       else if (Counter >= 4) Bit = 3;
       else if (Counter >= 3) Bit = 2;
       else if (Counter >= 2) Bit = 1;
-      size_t Feature = (i * 8 + Bit);
-      if (C->AddFeature(Feature, InputSize, Shrink))
-        Res++;
+      Bucket[Counter] = Bit;
     }
   }
+  uint8_t Bucket[256];
+};
+static const CounterBucketTable CounterBuckets;
+
+// Appends the feature of counter Idx to Features and clears the counter.
+static inline void CollectCounter(uint8_t *Counters, size_t Idx,
+                                  uint32_t *Features, size_t *NumFeatures) {
+  Features[(*NumFeatures)++] =
+      static_cast<uint32_t>(Idx * 8 + CounterBuckets.Bucket[Counters[Idx]]);
+  Counters[Idx] = 0;
+}
+
+// The counter scanning kernels, see CounterFeatureKernels(). Each one
+// writes the features of the non-zero counters among the first N to
+// Features, clears those counters and returns the number of features.
+// Counters must be 32-byte aligned.
+static size_t CollectCounterFeatures(uint8_t *Counters, size_t N,
+                                     uint32_t *Features) {
+  size_t Res = 0;
+  size_t Idx = 0;
+  for (; Idx + 8 <= N; Idx += 8) {
+    uint64_t Bundle;
+    memcpy(&Bundle, &Counters[Idx], sizeof(Bundle));
+    if (!Bundle) continue;
+    for (size_t i = Idx; i < Idx + 8; i++)
+      if (Counters[i])
+        CollectCounter(Counters, i, Features, &Res);
+  }
+  for (; Idx < N; Idx++)
+    if (Counters[Idx])
+      CollectCounter(Counters, Idx, Features, &Res);
+  return Res;
+}
+
+#ifdef __x86_64
+// SSE2 is always there on x86_64.
+static size_t CollectCounterFeaturesSSE2(uint8_t *Counters, size_t N,
+                                         uint32_t *Features) {
+  size_t Res = 0;
+  const __m128i Zero = _mm_setzero_si128();
+  size_t Idx = 0;
+  for (; Idx + 16 <= N; Idx += 16) {
+    __m128i V = _mm_load_si128(reinterpret_cast<__m128i *>(&Counters[Idx]));
+    unsigned NonZero = ~_mm_movemask_epi8(_mm_cmpeq_epi8(V, Zero)) & 0xffff;
+    for (; NonZero; NonZero &= NonZero - 1)
+      CollectCounter(Counters, Idx + __builtin_ctz(NonZero), Features, &Res);
+  }
+  for (; Idx < N; Idx++)
+    if (Counters[Idx])
+      CollectCounter(Counters, Idx, Features, &Res);
+  return Res;
+}
+
+ATTRIBUTE_TARGET_AVX2
+static size_t CollectCounterFeaturesAVX2(uint8_t *Counters, size_t N,
+                                         uint32_t *Features) {
+  size_t Res = 0;
+  const __m256i Zero = _mm256_setzero_si256();
+  size_t Idx = 0;
+  for (; Idx + 32 <= N; Idx += 32) {
+    __m256i V =
+        _mm256_load_si256(reinterpret_cast<__m256i *>(&Counters[Idx]));
+    uint32_t NonZero = ~static_cast<uint32_t>(
+        _mm256_movemask_epi8(_mm256_cmpeq_epi8(V, Zero)));
+    for (; NonZero; NonZero &= NonZero - 1)
+      CollectCounter(Counters, Idx + __builtin_ctz(NonZero), Features, &Res);
+  }
+  for (; Idx < N; Idx++)
+    if (Counters[Idx])
+      CollectCounter(Counters, Idx, Features, &Res);
+  return Res;
+}
+#endif  // __x86_64
+
+std::vector<CollectCounterFeaturesFn> CounterFeatureKernels() {
+  std::vector<CollectCounterFeaturesFn> Res = {CollectCounterFeatures};
+#ifdef __x86_64
+  Res.push_back(CollectCounterFeaturesSSE2);
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    Res.push_back(CollectCounterFeaturesAVX2);
+#endif
+  return Res;
+}
+
+size_t TracePC::FinalizeTrace(InputCorpus *C, size_t InputSize, bool Shrink) {
+  if (!UsingTracePcGuard()) return 0;
+  // The last kernel is the fastest one this CPU supports.
+  static const CollectCounterFeaturesFn Collect =
+      CounterFeatureKernels().back();
+  const size_t Step = 32;
+  assert(reinterpret_cast<uintptr_t>(Counters) % Step == 0);
+  size_t N = NumGuards + 1;
+  N = (N + Step - 1) & ~(Step - 1);  // Round up, NumCounters is a multiple.
+  assert(N <= NumCounters);
+  size_t NumCounterFeatures = 0;
+  // Few counters touched: visit just those. Otherwise a sequential scan
+  // of all of them is faster than jumping around.
+  if (!DirtyCountersOverflow && NumDirtyCounters < N / 16) {
+    for (size_t i = 0; i < NumDirtyCounters; i++)
+      if (Counters[DirtyCounters[i]])  // Not if it wrapped around to 0.
+        CollectCounter(Counters, DirtyCounters[i], CounterFeatures,
+                       &NumCounterFeatures);
+  } else {
+    NumCounterFeatures = Collect(Counters, N, CounterFeatures);
+  }
+  // Every counter is 0 again.
+  NumDirtyCounters = 0;
+  DirtyCountersOverflow = false;
+  size_t Res =
+      C->AddFeatures(CounterFeatures, NumCounterFeatures, InputSize, Shrink);
   if (UseValueProfile)
     ValueProfileMap.ForEach([&](size_t Idx) {
-      if (C->AddFeature(NumGuards + Idx, InputSize, Shrink))
+      if (C->AddFeature(FirstValueProfileFeature() + Idx, InputSize, Shrink))
         Res++;
     });
   return Res;
@@ -117,6 +279,8 @@ void TracePC::PrintNewPCs() {
   if (DoPrintNewPCs) {
     if (!PrintedPCs)
       PrintedPCs = new std::set<uintptr_t>;
+    if (NumCoveredPCs == NumCoveredPCsAtLastPrint) return;
+    NumCoveredPCsAtLastPrint = NumCoveredPCs;
     for (size_t i = 1; i < GetNumPCs(); i++)
       if (PCs[i] && PrintedPCs->insert(PCs[i]).second)
         PrintPC("\tNEW_PC: %p %F %L\n", "\tNEW_PC: %p\n", PCs[i]);
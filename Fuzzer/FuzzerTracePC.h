@@ -43,6 +43,12 @@ struct TableOfRecentCompares {
   Pair Table[kSize];
 };
 
+// The kernels TracePC::FinalizeTrace may scan the counters with: the
+// portable one first, then the ones this CPU supports, fastest last.
+typedef size_t (*CollectCounterFeaturesFn)(uint8_t *Counters, size_t N,
+                                           uint32_t *Features);
+std::vector<CollectCounterFeaturesFn> CounterFeatureKernels();
+
 class TracePC {
  public:
   static const size_t kFeatureSetSize = ValueBitMap::kNumberOfItems;
@@ -61,11 +67,22 @@ class TracePC {
     return UseValueProfile && MaxValueProfileMap->MergeFrom(ValueProfileMap);
   }
 
+  // Clears what the last input left in the counters and the value profile
+  // map, touching only what it touched.
   void ResetMaps() {
     ValueProfileMap.Reset();
-    memset(Counters, 0, sizeof(Counters));
+    if (DirtyCountersOverflow)
+      memset(Counters, 0, NumCounters);
+    else
+      for (size_t i = 0; i < NumDirtyCounters; i++)
+        Counters[DirtyCounters[i]] = 0;
+    NumDirtyCounters = 0;
+    DirtyCountersOverflow = false;
   }
 
+  // Forgets all PCs observed so far; the module and guard layout is kept.
+  void ResetCoverage();
+
   void UpdateFeatureSet(size_t CurrentElementIdx, size_t CurrentElementSize);
   void PrintFeatureSet();
 
@@ -80,12 +97,18 @@ class TracePC {
 
   bool UsingTracePcGuard() const {return NumModules; }
 
+  // Counter i gives features i * 8 to i * 8 + 7, value profile features
+  // come after the last counter's.
+  size_t FirstValueProfileFeature() const { return (NumGuards + 1) * 8; }
+
   static const size_t kTORCSize = 1 << 5;
   TableOfRecentCompares<uint32_t, kTORCSize> TORC4;
   TableOfRecentCompares<uint64_t, kTORCSize> TORC8;
 
   void PrintNewPCs();
-  size_t GetNumPCs() const { return Min(kNumPCs, NumGuards + 1); }
+  size_t GetNumPCs() const { return PCs ? NumGuards + 1 : 0; }
+  // Takes the PCs another process has covered, e.g. a fork server child.
+  void MergePCs(const uintptr_t *OtherPCs, size_t N);
   uintptr_t GetPC(size_t Idx) {
     assert(Idx < GetNumPCs());
     return PCs[Idx];
@@ -104,11 +127,23 @@ private:
   size_t NumModules = 0;
   size_t NumGuards = 0;
 
-  static const size_t kNumCounters = 1 << 14;
-  alignas(8) uint8_t Counters[kNumCounters];
-
-  static const size_t kNumPCs = 1 << 24;
-  uintptr_t PCs[kNumPCs];
+  // One counter and one PC per guard (and guard 0), allocated by
+  // HandleInit.
+  static const size_t kCounterAlignment = 64;  // A cache line.
+  void GrowGuardArrays(size_t MinNumCounters);
+  uint8_t *Counters = nullptr;
+  size_t NumCounters = 0;  // A multiple of kCounterAlignment.
+  // Features of the non-zero counters, collected by FinalizeTrace.
+  uint32_t *CounterFeatures = nullptr;
+  // The counters that went from 0 to 1 since the last ResetMaps or
+  // FinalizeTrace. A counter that wraps around goes in again, so on
+  // overflow all the counters have to be looked at.
+  uint32_t *DirtyCounters = nullptr;
+  size_t NumDirtyCounters = 0;
+  bool DirtyCountersOverflow = false;
+  uintptr_t *PCs = nullptr;  // 0 until the guard is first hit.
+  size_t NumCoveredPCs = 0;
+  size_t NumCoveredPCsAtLastPrint = 0;
 
   std::set<uintptr_t> *PrintedPCs;
 
@@ -243,6 +243,13 @@ void Fuzzer::InitializeTraceState() {
   TS = new TraceState(MD, Options, this);
 }
 
+void Fuzzer::ResetTraceState() {
+  RecordingMemcmp = false;
+  RecordingMemmem = false;
+  delete TS;
+  TS = nullptr;
+}
+
 static size_t InternalStrnlen(const char *S, size_t MaxLen) {
   size_t Len = 0;
   for (; Len < MaxLen && S[Len]; Len++) {}
@@ -67,6 +67,21 @@ std::string Sha1ToString(const uint8_t Sha1[kSHA1NumBytes]) {
   return SS.str();
 }
 
+bool ParseSha1(const std::string &Str, uint8_t Sha1[kSHA1NumBytes]) {
+  if (Str.size() != 2 * kSHA1NumBytes) return false;
+  for (int i = 0; i < 2 * kSHA1NumBytes; i++) {
+    char C = Str[i];
+    uint8_t V;
+    if (C >= '0' && C <= '9') V = C - '0';
+    else if (C >= 'a' && C <= 'f') V = C - 'a' + 10;
+    else if (C >= 'A' && C <= 'F') V = C - 'A' + 10;
+    else return false;
+    if (i % 2 == 0) Sha1[i / 2] = V << 4;
+    else Sha1[i / 2] |= V;
+  }
+  return true;
+}
+
 std::string Hash(const Unit &U) {
   uint8_t Hash[kSHA1NumBytes];
   ComputeSHA1(U.data(), U.size(), Hash);
@@ -85,16 +100,39 @@ static void InterruptHandler(int, siginfo_t *, void *) {
   Fuzzer::StaticInterruptCallback();
 }
 
+// Handlers that were installed before we replaced them, so that the host
+// process (e.g. a postgres backend) gets them back after a fuzzing session.
+static struct sigaction OldSigactions[NSIG];
+static bool HaveOldSigaction[NSIG];
+static struct rlimit OldCpuLimit;
+static bool HaveOldCpuLimit = false;
+
 static void SetSigaction(int signum,
                          void (*callback)(int, siginfo_t *, void *)) {
-  struct sigaction sigact;
+  struct sigaction sigact, old;
   memset(&sigact, 0, sizeof(sigact));
   sigact.sa_sigaction = callback;
-  if (sigaction(signum, &sigact, 0)) {
+  if (sigaction(signum, &sigact, &old)) {
     Printf("libFuzzer: sigaction failed with %d\n", errno);
     return;
 	//	exit(1);
   }
+  if (!HaveOldSigaction[signum]) {
+    OldSigactions[signum] = old;
+    HaveOldSigaction[signum] = true;
+  }
+}
+
+void RestoreSignalHandlers() {
+  for (int signum = 1; signum < NSIG; signum++) {
+    if (!HaveOldSigaction[signum]) continue;
+    sigaction(signum, &OldSigactions[signum], 0);
+    HaveOldSigaction[signum] = false;
+  }
+  if (HaveOldCpuLimit) {
+    setrlimit(RLIMIT_CPU, &OldCpuLimit);
+    HaveOldCpuLimit = false;
+  }
 }
 
 void SetTimer(int Seconds) {
@@ -108,15 +146,17 @@ void SetTimer(int Seconds) {
 
 	// Hack to use 1s SIGXCPU signal instead of SIGALRM
 	int Res;
+	if (!HaveOldCpuLimit) {
+		Res = getrlimit(RLIMIT_CPU, &OldCpuLimit);
+		assert(Res == 0);
+		HaveOldCpuLimit = true;
+	}
 	struct rlimit limit = {1, RLIM_INFINITY};
 	Res = setrlimit(RLIMIT_CPU, &limit);
 	assert(Res == 0);
+	(void)Res;
 
-	struct sigaction sigact;
-	memset(&sigact, 0, sizeof(sigact));
-	sigact.sa_sigaction = AlarmHandler;
-	Res = sigaction(SIGXCPU, &sigact, 0);
-	assert(Res == 0);
+	SetSigaction(SIGXCPU, AlarmHandler);
 }
 
 void SetSigSegvHandler() { SetSigaction(SIGSEGV, CrashHandler); }
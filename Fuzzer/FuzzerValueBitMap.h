@@ -24,8 +24,14 @@ struct ValueBitMap {
   static const size_t kMapSizeInWords = kMapSizeInBitsAligned / kBitsInWord;
  public:
   static const size_t kNumberOfItems = kMapSizeInBits;
-  // Clears all bits.
-  void Reset() { memset(Map, 0, sizeof(Map)); }
+  // Clears all bits. Only the words that have been set since the last
+  // Reset are touched.
+  void Reset() {
+    for (size_t i = 0; i < NumDirtyWords; i++)
+      Map[DirtyWords[i]] = 0;
+    NumDirtyWords = 0;
+    NumBits = 0;
+  }
 
   // Computes a hash function of Value and sets the corresponding bit.
   // Returns true if the bit was changed from 0 to 1.
@@ -36,6 +42,8 @@ struct ValueBitMap {
     uintptr_t Old = Map[WordIdx];
     uintptr_t New = Old | (1UL << BitIdx);
     Map[WordIdx] = New;
+    if (!Old)
+      MarkDirty(WordIdx);
     return New != Old;
   }
 
@@ -50,36 +58,50 @@ struct ValueBitMap {
 
   // Merges 'Other' into 'this', clears 'Other', updates NumBits,
   // returns true if new bits were added.
+  // Only the words set in Other are visited, and NumBits is updated by the
+  // bits they add rather than recounted over the whole map.
   ATTRIBUTE_TARGET_POPCNT
   bool MergeFrom(ValueBitMap &Other) {
-    uintptr_t Res = 0;
     size_t OldNumBits = NumBits;
-    for (size_t i = 0; i < kMapSizeInWords; i++) {
-      auto O = Other.Map[i];
-      auto M = Map[i];
-      if (O) {
-        Map[i] = (M |= O);
-        Other.Map[i] = 0;
-      }
-      if (M)
-        Res += __builtin_popcountl(M);
+    for (size_t k = 0; k < Other.NumDirtyWords; k++) {
+      size_t i = Other.DirtyWords[k];
+      uintptr_t O = Other.Map[i];
+      uintptr_t M = Map[i];
+      Other.Map[i] = 0;
+      if ((M | O) == M) continue;
+      if (!M)
+        MarkDirty(i);
+      Map[i] = M | O;
+      NumBits += __builtin_popcountl(O & ~M);
     }
-    NumBits = Res;
+    Other.NumDirtyWords = 0;  // All its words are 0 now.
     return OldNumBits < NumBits;
   }
 
+  // Calls CB with the index of every set bit, visiting only the non-zero
+  // words and only their set bits.
   template <class Callback>
   void ForEach(Callback CB) {
-    for (size_t i = 0; i < kMapSizeInWords; i++)
-      if (uintptr_t M = Map[i])
-        for (size_t j = 0; j < sizeof(M) * 8; j++)
-          if (M & ((uintptr_t)1 << j))
-            CB(i * sizeof(M) * 8 + j);
+    for (size_t k = 0; k < NumDirtyWords; k++) {
+      size_t i = DirtyWords[k];
+      for (uintptr_t M = Map[i]; M; M &= M - 1)
+        CB(i * kBitsInWord + __builtin_ctzl(M));
+    }
   }
 
  private:
+  // A word is dirty from when it becomes non-zero until the next Reset,
+  // so there is room for every word.
+  void MarkDirty(size_t WordIdx) {
+    DirtyWords[NumDirtyWords++] = static_cast<uint16_t>(WordIdx);
+  }
+
   size_t NumBits = 0;
-  uintptr_t Map[kMapSizeInWords] __attribute__((aligned(512)));
+  // Zeroed once here, e.g. for a ValueBitMap on the stack; from then on
+  // Reset only clears the dirty words.
+  uintptr_t Map[kMapSizeInWords] __attribute__((aligned(512))) = {};
+  size_t NumDirtyWords = 0;
+  uint16_t DirtyWords[kMapSizeInWords];
 };
 
 }  // namespace fuzzer
@@ -10,6 +10,7 @@
 #include "FuzzerDictionary.h"
 #include "FuzzerMutate.h"
 #include "FuzzerRandom.h"
+#include "FuzzerSharedCorpus.h"
 #include "gtest/gtest.h"
 #include <memory>
 #include <set>
@@ -598,3 +599,299 @@ TEST(Corpus, Distribution) {
     EXPECT_GT(Hist[i], TriesPerUnit / N / 3);
   }
 }
+
+TEST(Corpus, ArenaCompaction) {
+  InputCorpus C("");
+  const size_t N = 3000, Len = 1000;
+  // Unit i owns feature i until unit N + i, which is smaller, takes it.
+  for (size_t i = 0; i < N; i++) {
+    C.AddFeature(i, Len, true);
+    Unit U(Len, static_cast<uint8_t>(i));
+    memcpy(U.data(), &i, sizeof(i));
+    C.AddToCorpus(U, 1);
+  }
+  EXPECT_EQ(N * Len, C.SizeInBytes());
+  size_t FullCapacity = C.ArenaCapacity();
+  EXPECT_GE(FullCapacity, N * Len);
+  for (size_t i = 0; i < N; i++) {
+    EXPECT_TRUE(C.AddFeature(i, 1, true));
+    C.AddToCorpus(Unit{static_cast<uint8_t>(i), 1}, 1);
+  }
+  EXPECT_EQ(N, C.NumActiveUnits());
+  EXPECT_EQ(2 * N, C.SizeInBytes());
+  // Evicted units have been compacted away...
+  EXPECT_LT(C.ArenaCapacity(), FullCapacity / 2);
+  for (size_t i = 0; i < N; i++)
+    EXPECT_TRUE(C[i].empty());
+  // ...and the rest moved intact.
+  for (size_t i = 0; i < N; i++) {
+    UnitRef U = C[N + i];
+    ASSERT_EQ(2U, U.size());
+    EXPECT_EQ(static_cast<uint8_t>(i), U.data()[0]);
+    EXPECT_EQ(1, U.data()[1]);
+  }
+}
+
+TEST(Corpus, Sha1Set) {
+  Sha1Set S;
+  uint8_t H[kSHA1NumBytes];
+  for (uint32_t i = 0; i < 10000; i++) {
+    ComputeSHA1(reinterpret_cast<uint8_t *>(&i), sizeof(i), H);
+    EXPECT_TRUE(S.insert(H));
+  }
+  EXPECT_EQ(10000U, S.size());
+  for (uint32_t i = 0; i < 20000; i++) {
+    ComputeSHA1(reinterpret_cast<uint8_t *>(&i), sizeof(i), H);
+    EXPECT_EQ(i < 10000, S.count(H));
+  }
+  EXPECT_TRUE(S.insert(H));
+  EXPECT_FALSE(S.insert(H));
+  EXPECT_EQ(10001U, S.size());
+
+  InputCorpus C("");
+  Unit U = {'a', 'b', 'c'};
+  C.AddToCorpus(U, 0);
+  EXPECT_TRUE(C.HasUnit(U));
+  EXPECT_TRUE(C.HasUnit(Hash(U)));
+  EXPECT_FALSE(C.HasUnit(Unit{'a', 'b'}));
+  EXPECT_FALSE(C.HasUnit("not a hash"));
+}
+
+TEST(Util, ParseSha1) {
+  uint8_t H[kSHA1NumBytes], P[kSHA1NumBytes];
+  ComputeSHA1(reinterpret_cast<const uint8_t *>("xyz"), 3, H);
+  EXPECT_TRUE(ParseSha1(Sha1ToString(H), P));
+  EXPECT_EQ(0, memcmp(H, P, kSHA1NumBytes));
+  EXPECT_FALSE(ParseSha1("abc", P));
+  EXPECT_FALSE(ParseSha1(std::string(2 * kSHA1NumBytes, 'g'), P));
+}
+
+TEST(Corpus, FeatureSetBookkeeping) {
+  // ValidateFeatureSet asserts that the counts kept by AddFeature match.
+  InputCorpus C("", /*ValidateFeatures=*/true);
+  C.AddFeature(1, 5, true);
+  C.AddFeature(2, 5, true);
+  C.AddToCorpus(Unit{1, 2, 3, 4, 5}, 2);
+  EXPECT_EQ(2U, C.NumFeatures());
+  // A smaller unit takes over feature 2 and adds feature 3.
+  EXPECT_TRUE(C.AddFeature(2, 3, true));
+  EXPECT_TRUE(C.AddFeature(InputCorpus::kFeatureSetSize + 3, 3, true));
+  EXPECT_FALSE(C.AddFeature(1, 3, false));
+  C.AddToCorpus(Unit{1, 2, 3}, 2);
+  EXPECT_EQ(3U, C.NumFeatures());
+  // Taking over the last feature of the first unit evicts it.
+  EXPECT_TRUE(C.AddFeature(1, 1, true));
+  C.AddToCorpus(Unit{1}, 1);
+  EXPECT_EQ(3U, C.NumFeatures());
+  EXPECT_EQ(2U, C.NumActiveUnits());
+}
+
+TEST(Corpus, LargeFeatureIndices) {
+  InputCorpus C("", /*ValidateFeatures=*/true);
+  // These used to collide in a 64K table.
+  EXPECT_TRUE(C.AddFeature(7, 5, true));
+  EXPECT_TRUE(C.AddFeature(7 + (1 << 16), 5, true));
+  EXPECT_TRUE(C.AddFeature(7 + (100 << 16), 5, true));
+  C.AddToCorpus(Unit{1, 2, 3, 4, 5}, 3);
+  EXPECT_EQ(3U, C.NumFeatures());
+  uint32_t Features[] = {7, 7 + (1 << 16), 7 + (100 << 16)};
+  EXPECT_TRUE(C.HasFeatures(Features, 3));
+  uint32_t Missing[] = {7 + (2 << 16)};
+  EXPECT_FALSE(C.HasFeatures(Missing, 1));
+}
+
+TEST(Corpus, WeightedSampler) {
+  Random Rand(0);
+  WeightedSampler S;
+  std::vector<uint64_t> W;
+  for (size_t i = 0; i < 1000; i++) {
+    uint64_t Weight = Rand(4) ? Rand(100) : 0;
+    S.push_back(Weight);
+    W.push_back(Weight);
+    if (i % 7 == 0) {
+      size_t Idx = Rand(W.size());
+      W[Idx] = Rand(3) ? Rand(1000) : 0;
+      S.Set(Idx, W[Idx]);
+    }
+  }
+  auto Check = [&]() {
+    uint64_t Sum = 0;
+    for (size_t i = 0; i < W.size(); i++) {
+      for (uint64_t P = Sum; P < Sum + W[i]; P += 1 + W[i] / 4)
+        EXPECT_EQ(i, S.Find(P));
+      Sum += W[i];
+    }
+    EXPECT_EQ(Sum, S.Total());
+  };
+  Check();
+  for (auto &X : W)
+    X = Rand(50);
+  S.Assign(W);
+  Check();
+}
+
+TEST(ValueBitMap, ResetTouchedWords) {
+  static ValueBitMap A, B;
+  EXPECT_TRUE(A.AddValue(1));
+  EXPECT_TRUE(A.AddValue(2));
+  EXPECT_TRUE(A.AddValue(5000));
+  EXPECT_FALSE(A.AddValue(5000));
+  EXPECT_TRUE(B.MergeFrom(A));
+  EXPECT_FALSE(A.Get(5000));
+  EXPECT_TRUE(B.Get(5000));
+  EXPECT_EQ(3U, B.GetNumBitsSinceLastMerge());
+  // A's words were cleared by the merge and can be set again.
+  EXPECT_TRUE(A.AddValue(5000));
+  A.Reset();
+  B.Reset();
+  for (size_t i = 0; i < ValueBitMap::kNumberOfItems; i++) {
+    ASSERT_FALSE(A.Get(i));
+    ASSERT_FALSE(B.Get(i));
+  }
+  // Every word dirty at once fits.
+  for (size_t i = 0; i < ValueBitMap::kNumberOfItems; i++)
+    A.AddValue(i);
+  A.Reset();
+  for (size_t i = 0; i < ValueBitMap::kNumberOfItems; i++)
+    ASSERT_FALSE(A.Get(i));
+}
+
+TEST(ValueBitMap, StartsClearOnDirtyMemory) {
+  // Like MaxCoverage.VPMap in a Fuzzer that lives on the stack.
+  std::unique_ptr<uint8_t[]> Mem(new uint8_t[sizeof(ValueBitMap) + 512]);
+  void *Aligned = reinterpret_cast<void *>(
+      (reinterpret_cast<uintptr_t>(Mem.get()) + 511) & ~uintptr_t(511));
+  memset(Aligned, 0xff, sizeof(ValueBitMap));
+  ValueBitMap *A = new (Aligned) ValueBitMap;  // Not value-initialized.
+  for (size_t i = 0; i < ValueBitMap::kNumberOfItems; i++)
+    ASSERT_FALSE(A->Get(i));
+  size_t NumSet = 0;
+  A->ForEach([&](size_t) { NumSet++; });
+  EXPECT_EQ(NumSet, 0U);
+
+  static ValueBitMap B;
+  EXPECT_TRUE(B.AddValue(42));
+  EXPECT_TRUE(A->MergeFrom(B));
+  EXPECT_EQ(A->GetNumBitsSinceLastMerge(), 1U);
+  A->Reset();
+  EXPECT_FALSE(A->Get(42));
+  A->~ValueBitMap();
+}
+
+TEST(ValueBitMap, ForEachAndMerge) {
+  static ValueBitMap A, B;
+  std::set<size_t> Values = {0, 1, 63, 64, 65, 1000, 40000, 65370};
+  for (auto V : Values)
+    A.AddValue(V);
+  std::set<size_t> Seen;
+  A.ForEach([&](size_t Idx) { EXPECT_TRUE(Seen.insert(Idx).second); });
+  EXPECT_EQ(Values, Seen);
+  EXPECT_TRUE(B.MergeFrom(A));
+  EXPECT_EQ(Values.size(), B.GetNumBitsSinceLastMerge());
+  // Merging bits B already has adds nothing.
+  A.AddValue(63);
+  A.AddValue(40000);
+  EXPECT_FALSE(B.MergeFrom(A));
+  A.AddValue(62);
+  EXPECT_TRUE(B.MergeFrom(A));
+  EXPECT_EQ(Values.size() + 1, B.GetNumBitsSinceLastMerge());
+  B.Reset();
+}
+
+TEST(TracePC, CounterFeatureKernels) {
+  auto Kernels = CounterFeatureKernels();
+  ASSERT_GE(Kernels.size(), 1U);
+  Random Rand(0);
+  alignas(64) uint8_t Reference[256];
+  alignas(64) uint8_t Counters[256];
+  uint32_t ExpectedFeatures[256], Features[256];
+  for (size_t N : {0, 1, 7, 15, 17, 31, 33, 63, 100, 255, 256}) {
+    for (int Iter = 0; Iter < 20; Iter++) {
+      // Mostly zeros, as in practice, with the odd run of set counters.
+      for (size_t i = 0; i < sizeof(Reference); i++)
+        Reference[i] = Rand(4) ? 0 : Rand(256);
+      memcpy(Counters, Reference, sizeof(Counters));
+      size_t NumExpected = Kernels[0](Counters, N, ExpectedFeatures);
+      for (size_t i = 0; i < sizeof(Counters); i++)
+        EXPECT_EQ(Counters[i], i < N ? 0 : Reference[i]);
+      for (size_t K = 1; K < Kernels.size(); K++) {
+        memcpy(Counters, Reference, sizeof(Counters));
+        size_t NumFeatures = Kernels[K](Counters, N, Features);
+        ASSERT_EQ(NumFeatures, NumExpected) << "kernel " << K << " N " << N;
+        EXPECT_TRUE(std::equal(Features, Features + NumFeatures,
+                               ExpectedFeatures));
+        for (size_t i = 0; i < sizeof(Counters); i++)
+          EXPECT_EQ(Counters[i], i < N ? 0 : Reference[i]);
+      }
+    }
+  }
+}
+
+TEST(SharedCorpus, PublishAndFetch) {
+  const size_t NumSlots = 4, MaxUnitSize = 8;
+  std::vector<uint64_t> Mem(
+      SharedCorpus::SizeFor(NumSlots, MaxUnitSize) / sizeof(uint64_t) + 1);
+  SharedCorpus *SC = SharedCorpus::Create(Mem.data(), NumSlots, MaxUnitSize);
+  uint32_t A = SC->Join(), B = SC->Join();
+  EXPECT_NE(A, B);
+  uint32_t Features[] = {1, 2, 3};
+  EXPECT_TRUE(SC->Publish(A, (const uint8_t *)"abc", 3, Features, 3));
+  EXPECT_FALSE(SC->Publish(A, (const uint8_t *)"too long!", 9, nullptr, 0));
+
+  std::vector<Unit> Units;
+  size_t LastNumFeatures = 0;
+  auto Collect = [&](const Unit &U, const uint32_t *F, size_t NF) {
+    Units.push_back(U);
+    LastNumFeatures = NF;
+  };
+  uint64_t CursorA = 0, CursorB = 0;
+  // A does not see its own units.
+  EXPECT_EQ(SC->Fetch(A, &CursorA, Collect), 0U);
+  EXPECT_EQ(SC->Fetch(B, &CursorB, Collect), 1U);
+  EXPECT_EQ(Units, std::vector<Unit>({Unit({'a', 'b', 'c'})}));
+  EXPECT_EQ(LastNumFeatures, 3U);
+  EXPECT_EQ(SC->Fetch(B, &CursorB, Collect), 0U);
+
+  // A reader that falls behind loses the oldest units.
+  Units.clear();
+  for (uint8_t i = 0; i < 2 * NumSlots; i++)
+    SC->Publish(A, &i, 1, nullptr, 0);
+  EXPECT_EQ(SC->Fetch(B, &CursorB, Collect), NumSlots);
+  EXPECT_EQ(Units.front(), Unit(1, NumSlots));
+  EXPECT_EQ(Units.back(), Unit(1, 2 * NumSlots - 1));
+}
+
+TEST(SharedCorpus, SharedFile) {
+  const size_t NumSlots = 4, MaxUnitSize = 8;
+  std::string Path = "libFuzzer-unittest-" + std::to_string(GetPid());
+  size_t Size = SharedCorpus::SizeFor(NumSlots, MaxUnitSize);
+  void *Mem = MapSharedFile(Path, &Size, /*Create=*/true);
+  ASSERT_NE(Mem, nullptr);
+  EXPECT_EQ(MapSharedFile(Path, &Size, /*Create=*/true), nullptr);
+  SharedCorpus *A = SharedCorpus::Create(Mem, NumSlots, MaxUnitSize);
+
+  size_t OtherSize = 0;
+  void *OtherMem = MapSharedFile(Path, &OtherSize, /*Create=*/false);
+  ASSERT_NE(OtherMem, nullptr);
+  EXPECT_EQ(OtherSize, Size);
+  EXPECT_EQ(SharedCorpus::Attach(OtherMem, OtherSize - 1), nullptr);
+  SharedCorpus *B = SharedCorpus::Attach(OtherMem, OtherSize);
+  ASSERT_NE(B, nullptr);
+  EXPECT_EQ(B->MaxUnitSize(), MaxUnitSize);
+
+  uint32_t IdA = A->Join(), IdB = B->Join();
+  EXPECT_NE(IdA, IdB);
+  A->Publish(IdA, (const uint8_t *)"abc", 3, nullptr, 0);
+  std::vector<Unit> Units;
+  uint64_t Cursor = 0;
+  B->Fetch(IdB, &Cursor, [&](const Unit &U, const uint32_t *, size_t) {
+    Units.push_back(U);
+  });
+  EXPECT_EQ(Units, std::vector<Unit>({Unit({'a', 'b', 'c'})}));
+
+  UnmapSharedFile(OtherMem, OtherSize);
+  UnmapSharedFile(Mem, Size);
+  DeleteFile(Path);
+  std::vector<uint8_t> Junk(Size);
+  EXPECT_EQ(SharedCorpus::Attach(Junk.data(), Junk.size()), nullptr);
+}
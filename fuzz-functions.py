@@ -23,6 +23,12 @@ functions_query = (
 
 conn_string = "host='/tmp'"
 
+# --fork-server[=N] runs each backend's inputs in forked children, N per
+# child (see fuzz.fork_server_batch in test_pg.c). It is off by default: a
+# child that dies holding an LWLock or a buffer pin leaves it behind in
+# the backend.
+fork_server_batch = 0
+
 # These are just too slow to fuzz
 problem_functions = [
     'ts_debug',
@@ -101,7 +107,7 @@ dummy_args = {
     'tsvector' : [''],
 }
 
-def fuzz(proname, proargs, arg_to_test):
+def fuzz(connection, proname, proargs, arg_to_test):
     arglists = []
     for i in range(0,len(proargs)):
         arg = proargs[i]
@@ -114,23 +120,49 @@ def fuzz(proname, proargs, arg_to_test):
     for args in itertools.product(*arglists):
         query = 'select "%s"(%s)' % (proname, ', '.join(args))
         print(query)
+    run_fuzz(connection, query)
+
+# fuzz() splits each input across all the parameters so when we know how
+# to feed every argument type we can explore them all in one campaign
+def fuzz_all_args(connection, proname, proargs):
+    args = ["$%d::%s" % (i+1, proargs[i]) for i in range(0,len(proargs))]
+    query = 'select "%s"(%s)' % (proname, ', '.join(args))
+    print(query)
+    run_fuzz(connection, query)
+
+def run_fuzz(connection, query):
+    # The fuzzer resets itself after each run so we can keep reusing
+    # the same backend, only reconnect if the last run killed it
+    with connection.cursor() as cur:
+        try:
+            cur.execute("select fuzz(100000, '%s')" % query.replace("'", "''"))
+        except psycopg2.Error as e:
+            print e.pgcode
+            print e.pgerror
+            pass
 
-    # Need a fresh connection due to fuzzer being only capable of running once
-    with psycopg2.connect(conn_string) as connection:
-        with connection.cursor() as cur:
-            cur.execute("set max_stack_depth='7680kB'")
-            try:
-                cur.execute("select fuzz(100000, '%s')" % query.replace("'", "''"))
-            except psycopg2.Error as e:
-                print e.pgcode
-                print e.pgerror
-                pass
+def connect():
+    connection = psycopg2.connect(conn_string)
+    connection.autocommit = True
+    with connection.cursor() as cur:
+        cur.execute("set max_stack_depth='7680kB'")
+        if fork_server_batch:
+            cur.execute("set fuzz.fork_server_batch=%d" % fork_server_batch)
+    return connection
 
 def main():
-    with psycopg2.connect(conn_string) as connection:
-        with connection.cursor() as cur:
-            cur.execute(functions_query)
-            functions = cur.fetchall()
+    global fork_server_batch
+    for arg in sys.argv[1:]:
+        if arg == '--fork-server':
+            fork_server_batch = 10000
+        elif arg.startswith('--fork-server='):
+            fork_server_batch = int(arg[len('--fork-server='):])
+        else:
+            sys.exit("usage: %s [--fork-server[=N]]" % sys.argv[0])
+    connection = connect()
+    with connection.cursor() as cur:
+        cur.execute(functions_query)
+        functions = cur.fetchall()
     for f in functions:
         (proname,proargs) = f
         if proname in problem_functions:
@@ -138,9 +170,16 @@ def main():
         if proname.find("regex") > -1:
             print "skipping regex function %s" % proname
             continue
+        if connection.closed:
+            connection = connect()
+        if len(proargs) > 1 and all(a in dummy_args for a in proargs):
+            fuzz_all_args(connection, proname, proargs)
+            continue
         for i in range(0,len(proargs)):
             if proargs[i] in testable_types:
-                fuzz(proname, proargs, i)
+                if connection.closed:
+                    connection = connect()
+                fuzz(connection, proname, proargs, i)
 
 if __name__ == "__main__":
     main()
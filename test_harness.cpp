@@ -1,44 +1,160 @@
 #include "Fuzzer/FuzzerInterface.h"
 #include "Fuzzer/FuzzerInternal.h"
+#include "Fuzzer/FuzzerSharedCorpus.h"
+#include "Fuzzer/FuzzerTracePC.h"
 #include <string.h>
 #include <signal.h>
 
 extern "C" int FuzzOne(const uint8_t *Data, size_t Size);
-extern "C" int GoFuzz(unsigned runs);
+extern "C" int GoFuzz(unsigned runs, int binary);
+extern "C" void ResetFuzzer();
+extern "C" size_t SharedCorpusSize(size_t slots, size_t unit_size);
+extern "C" void CreateSharedCorpus(void *mem, size_t slots, size_t unit_size);
+extern "C" void SetFuzzSharedCorpus(void *mem);
+extern "C" void SetFuzzForkServer(size_t batch, void (*child_start)(void),
+								  void (*child_exit)(void),
+								  bool (*should_stop)(void));
+extern "C" void InputHash(const uint8_t *data, size_t size, char *hash);
+extern "C" void ErrorFeature(int sqlerrcode, uint32_t template_hash);
+extern "C" void SetFuzzCorpusTable(int on);
+/* in test_pg.c */
+extern "C" void ReadCorpusTable(void (*add_unit)(void *arg, const uint8_t *data,
+												 size_t size),
+								void *arg);
+extern "C" void WriteCorpusTable(const uint8_t *data, size_t size,
+								 const char *sha1, size_t num_features);
 extern "C" void aborthandler(int signum, siginfo_t *info, void *cxt);
 extern "C" void staticdeathcallback();
-//extern "C" void errorcallback(const char *errorname);
+extern "C" void errorcallback(const char *errorname);
 
-int GoFuzz(unsigned runs) {
+static struct sigaction old_abort_action;
+static fuzzer::SharedCorpus *shared_corpus;
+
+/* Keeps the corpus in the table named by fuzz.corpus_table instead of
+ * in /var/tmp/corpus, the SQL lives in test_pg.c */
+class TableCorpusStore : public fuzzer::CorpusStore {
+public:
+	void ReadNewUnits(fuzzer::UnitVector *V, size_t MaxSize) override {
+		AddArgs args = {V, MaxSize};
+		ReadCorpusTable(AddUnit, &args);
+	}
+	void WriteUnit(const fuzzer::Unit &U, const std::string &Sha1,
+				   size_t NumFeatures) override {
+		WriteCorpusTable(U.data(), U.size(), Sha1.c_str(), NumFeatures);
+	}
+private:
+	struct AddArgs {
+		fuzzer::UnitVector *V;
+		size_t MaxSize;
+	};
+	static void AddUnit(void *arg, const uint8_t *data, size_t size) {
+		AddArgs *args = static_cast<AddArgs *>(arg);
+		args->V->push_back(fuzzer::Unit(data, data + std::min(size, args->MaxSize)));
+	}
+};
+
+static TableCorpusStore table_corpus;
+static bool use_corpus_table;
+
+/* binary inputs (e.g. for receive functions) get their own corpus since
+ * the text targets' corpus is restricted to ASCII */
+int GoFuzz(unsigned runs, int binary) {
 	char runarg[] = "-runs=400000000999";
 	sprintf(runarg, "-runs=%u", runs);
 	char *argvdata[] = {
 		"PostgresFuzzer",
 		runarg,
 		"-verbosity=1",
-		"-only_ascii=1",
+		binary ? (char *)"-only_ascii=0" : (char *)"-only_ascii=1",
 		"-timeout=60",
 		"-report_slow_units=1",
 		"-handle_int=0",
+		/* leave SIGTERM to postgres so backends and workers can be
+		 * terminated */
+		"-handle_term=0",
+		/* with a shared corpus there is no need to poll the directory */
+		shared_corpus ? (char *)"-reload=0" : (char *)"-reload=1",
 		"-use_counters=1",
 		"-use_indir_calls=1",
 		"-use_memcmp=1",
 		"-use_memmem=1",
 		"-use_value_profile=1",
-		"/var/tmp/corpus",
 		"-max_len=32",
+		/* last so it can be left out when the corpus is in a table */
+		use_corpus_table ? NULL :
+		binary ? (char *)"/var/tmp/corpus-binary" : (char *)"/var/tmp/corpus",
 		NULL
 	};
 	char **argv = argvdata;
-	int argc = sizeof(argvdata)/sizeof(*argvdata) - 1;
+	int argc = 0;
+	while (argv[argc])
+		argc++;
 
 	/* Catch abort and print out the test case */
 	struct sigaction sigact;
 	memset(&sigact, 0, sizeof(sigact));
 	sigact.sa_sigaction = aborthandler;
-	sigaction(SIGABRT, &sigact, 0);
+	sigaction(SIGABRT, &sigact, &old_abort_action);
+
+	fuzzer::SetSharedCorpus(shared_corpus);
+	if (use_corpus_table)
+		fuzzer::SetCorpusStore(&table_corpus);
+	int retval = fuzzer::FuzzerDriver(&argc, &argv, FuzzOne);
+	ResetFuzzer();
+	return retval;
+}
+
+/* Put the backend back the way we found it so fuzz() can be called
+ * again in the same session. Also called from fuzz() when an error
+ * longjmps out of the driver and skips its destructors. */
+void ResetFuzzer() {
+	fuzzer::ResetFuzzerDriver();
+	shared_corpus = NULL;
+	use_corpus_table = false;
+	sigaction(SIGABRT, &old_abort_action, 0);
+}
+
+/* The ring fuzz_parallel() workers exchange new inputs through, see
+ * Fuzzer/FuzzerSharedCorpus.h. It lives in a DSM segment so it can't
+ * contain pointers. */
+size_t SharedCorpusSize(size_t slots, size_t unit_size) {
+	return fuzzer::SharedCorpus::SizeFor(slots, unit_size);
+}
+
+void CreateSharedCorpus(void *mem, size_t slots, size_t unit_size) {
+	fuzzer::SharedCorpus::Create(mem, slots, unit_size);
+}
+
+/* Use the ring in mem for the next GoFuzz() */
+void SetFuzzSharedCorpus(void *mem) {
+	shared_corpus = static_cast<fuzzer::SharedCorpus *>(mem);
+}
 
-	return fuzzer::FuzzerDriver(&argc, &argv, FuzzOne);
+/* Run the next GoFuzz() as a fork server, see Fuzzer::ForkServerLoop */
+void SetFuzzForkServer(size_t batch, void (*child_start)(void),
+					   void (*child_exit)(void), bool (*should_stop)(void)) {
+	fuzzer::SetForkServer(batch, child_start, child_exit, should_stop);
+}
+
+/* Load and save the corpus of the next GoFuzz() with ReadCorpusTable()
+ * and WriteCorpusTable() */
+void SetFuzzCorpusTable(int on) {
+	use_corpus_table = on;
+}
+
+/* The name libFuzzer gives an input in the corpus or a crash- file,
+ * hash must have room for 41 bytes */
+void InputHash(const uint8_t *data, size_t size, char *hash) {
+	strcpy(hash, fuzzer::Hash(fuzzer::Unit(data, data + size)).c_str());
+}
+
+/* Count the error an input raised as value profile coverage so that an
+ * input reaching a new SQLSTATE or a new message template for one is
+ * kept like one reaching a new edge. The multiplier just spreads the
+ * packed SQLSTATEs, which mostly differ in their low bits, over the map */
+void ErrorFeature(int sqlerrcode, uint32_t template_hash) {
+	fuzzer::TPC.HandleValueProfile((uint32_t) sqlerrcode * 2654435761U);
+	fuzzer::TPC.HandleValueProfile(template_hash ^ (uint32_t) sqlerrcode);
 }
 
 void aborthandler(int signum, siginfo_t *info, void *cxt) {
@@ -53,6 +169,8 @@ void aborthandler(int signum, siginfo_t *info, void *cxt) {
 //	fuzzer::Fuzzer::StaticDeathCallback();
 //}	
 
-//void errorcallback(const char *errorname) {
-//	fuzzer::Fuzzer::StaticErrorCallback(errorname);
-//}	
+/* Save the current input as <errorname>-<sha1> like a crash- file but
+ * keep going */
+void errorcallback(const char *errorname) {
+	fuzzer::Fuzzer::StaticErrorCallback(errorname);
+}
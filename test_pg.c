@@ -9,24 +9,341 @@
 #include "utils/builtins.h"
 #include "utils/memutils.h"
 #include "utils/guc.h"
+#include "utils/lsyscache.h"
+#include "catalog/pg_collation.h"
+#include "parser/analyze.h"
+#include "tcop/tcopprot.h"
 #include "access/xact.h"
+#include "catalog/pg_proc.h"
+#include "catalog/namespace.h"
+#include "postmaster/bgworker.h"
+#include "storage/dsm.h"
+#include "storage/fd.h"
+#include "utils/resowner.h"
+#include "utils/snapmgr.h"
+#include "utils/syscache.h"
+#include "access/hash.h"
+#include "port/atomics.h"
+#include "storage/lwlock.h"
+#include "storage/proc.h"
+#include "storage/shmem.h"
+#include "utils/hsearch.h"
+#include "utils/tuplestore.h"
 #include "regex/regex.h"
 #include "lib/stringinfo.h"
 
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/resource.h>
-
-extern void GoFuzz();
+#include <unistd.h>
+
+extern int GoFuzz(unsigned runs, int binary);
+extern void ResetFuzzer();
+extern size_t SharedCorpusSize(size_t slots, size_t unit_size);
+extern void CreateSharedCorpus(void *mem, size_t slots, size_t unit_size);
+extern void SetFuzzSharedCorpus(void *mem);
+extern void SetFuzzForkServer(size_t batch, void (*child_start)(void),
+							  void (*child_exit)(void),
+							  bool (*should_stop)(void));
+extern void InputHash(const uint8_t *data, size_t size, char *hash);
+extern void ErrorFeature(int sqlerrcode, uint32 template_hash);
+extern void SetFuzzCorpusTable(int on);
 //extern void staticdeathcallback();
-//extern void errorcallback(const char *errorname);
+extern void errorcallback(const char *errorname);
 
 static int in_fuzzer;
 
+/* Subtransaction shared by consecutive successful inputs, see fuzz() */
+static int batch_size = 1;
+static int batch_count;
+static ResourceOwner batch_owner;
+
+/* Per-session FuzzOne statistics, reset at the start of every fuzz() */
+static unsigned long n_execs, n_success, n_fail, n_null;
+static unsigned long n_empty_args;	/* inputs leaving an argument empty */
+static unsigned long n_roundtrip;	/* round trip checks that failed */
+static int last_error, last_error_count;
+
+static void reset_fuzz_stats();
+static void release_batch();
+static void reset_error_stats();
+static Size fuzz_shmem_size(void);
+static void fuzz_shmem_startup(void);
+static shmem_startup_hook_type prev_shmem_startup_hook;
+
 PG_MODULE_MAGIC;
 
 SPIPlanPtr plan;
 
+/* What FuzzOne does with each input */
+static enum {
+	FUZZ_PLAN,			/* fuzz(): execute "plan" through SPI */
+	FUZZ_FUNCTION,		/* fuzz_function(): call fuzz_flinfo directly */
+	FUZZ_RECV			/* fuzz_recv(): call a typreceive function */
+} fuzz_mode;
+
+/* State for the modes which bypass SPI and call fmgr directly */
+static FmgrInfo fuzz_flinfo;
+static FunctionCallInfoData fuzz_fcinfo;
+static StringInfoData fuzz_recv_buf;
+
+/* Arguments (or query parameters) each input is split into */
+#define FUZZ_MAX_ARGS 8
+static int fuzz_nargs;
+static Oid fuzz_argtypes[FUZZ_MAX_ARGS];
+static FmgrInfo fuzz_input_flinfo[FUZZ_MAX_ARGS];
+static Oid fuzz_typioparams[FUZZ_MAX_ARGS];
+
+/* Everything built or allocated for one input is thrown away after it */
+static MemoryContext fuzz_call_context;
+
+/*
+ * fuzz.roundtrip: also check that every value parsed from an input comes
+ * back unchanged through the type's output/input and send/receive
+ * functions. A value that doesn't is saved as a roundtrip- file. It is
+ * not raised as an error, a type that fails the same way for every input
+ * would otherwise look like a broken harness to FuzzOne and end the
+ * session.
+ */
+static bool fuzz_roundtrip_guc = false;
+static bool fuzz_check_roundtrip;
+
+typedef struct RoundTripInfo {
+	Oid typid;
+	Oid typioparam;
+	FmgrInfo input;
+	FmgrInfo output;
+	bool binary;			/* has send and receive functions */
+	FmgrInfo send;
+	FmgrInfo receive;
+	unsigned long failures;	/* only the first one is saved */
+} RoundTripInfo;
+
+static RoundTripInfo fuzz_roundtrip[FUZZ_MAX_ARGS];
+
+/*
+ * fuzz.fork_server_batch: when set the backend only keeps the corpus and
+ * the coverage while forked children run the inputs, this many each.
+ * A FATAL error, a stack overflow or a crash then only kills the child
+ * and costs the one input it was running, which is saved as a crash-
+ * file, and the next child carries on with everything found so far.
+ *
+ * The children share our PGPROC and shared memory. They never talk to
+ * the client or run our exit callbacks. An error that would end the
+ * session here ends the child instead and is raised again by us (see
+ * fuzz_child_stop()), it never gets to the transaction abort in
+ * PostgresMain, which would do it to our PGPROC and locks. Children run
+ * read-only and roll back the subtransaction of every input instead of
+ * committing it, which releases the heavyweight locks it took; a commit
+ * would only hand them on to the transaction in the child's local lock
+ * table and leave them in the shared one for good. Children still must
+ * not wait for a lock or on the latch, which is ours, so such waits
+ * error out. One that dies holding a buffer pin or an LWLock leaves it
+ * behind, the postmaster doesn't know about it. Targets that only use
+ * relations and catalog entries the backend already has locked and cached
+ * (the initial corpus has run through them before the first fork) are
+ * fine.
+ *
+ * Children get their own MyProcPid, so that a timeout signals them and
+ * not us, but count their errors under our pid in fuzz_error_stats()
+ * along with ours: they are part of the same session, and their rows
+ * go away with it. Without shared_preload_libraries only the inputs we
+ * ran ourselves are counted. We reload the corpus directory or table
+ * between children.
+ */
+static int fuzz_fork_server_batch = 0;
+
+/* What a fork server child left for its parent when it stopped the
+ * session, in memory they share */
+typedef struct FuzzForkStop {
+	int sqlerrcode;				/* 0 unless a child stopped the session */
+	char message[256];
+} FuzzForkStop;
+
+static FuzzForkStop *fuzz_fork_stop;
+static bool fuzz_in_child;
+
+/*
+ * fuzz.corpus_table: keep the corpus in this table instead of in
+ * /var/tmp/corpus, with every target's inputs told apart by the target
+ * column. Sessions start from the rows of their target and pick up the
+ * rows other sessions commit whenever libFuzzer would reload the corpus
+ * directory. See ReadCorpusTable() for what the table has to look like
+ * and WriteCorpusTable() for how inputs survive a rollback.
+ */
+static char *fuzz_corpus_table_guc = NULL;
+
+/* The session's quoted fuzz.corpus_table and target, NULL if unused */
+static char *fuzz_corpus_table;
+static char *fuzz_corpus_target;
+/* Names of the table's spool files start with this, see WriteCorpusTable() */
+static char *fuzz_corpus_spool_prefix;
+static bool fuzz_corpus_spool_loaded;
+/* SHA1s of the inputs the session already has from or gave to the table */
+static HTAB *fuzz_corpus_seen;
+
+void _PG_init(void);
+
+void
+_PG_init(void)
+{
+	DefineCustomBoolVariable("fuzz.roundtrip",
+							 "Check fuzzed values survive output/input and send/receive round trips.",
+							 NULL,
+							 &fuzz_roundtrip_guc,
+							 false,
+							 PGC_USERSET,
+							 0,
+							 NULL, NULL, NULL);
+	DefineCustomIntVariable("fuzz.fork_server_batch",
+							"Run inputs in forked children, this many per child (0 runs them in the backend).",
+							NULL,
+							&fuzz_fork_server_batch,
+							0,
+							0, 1000000,
+							PGC_USERSET,
+							0,
+							NULL, NULL, NULL);
+	DefineCustomStringVariable("fuzz.corpus_table",
+							   "Table to keep the corpus in instead of /var/tmp/corpus.",
+							   NULL,
+							   &fuzz_corpus_table_guc,
+							   NULL,
+							   PGC_USERSET,
+							   0,
+							   NULL, NULL, NULL);
+
+	/* Error statistics of all fuzzing backends, see fuzz_error_stats() */
+	if (process_shared_preload_libraries_in_progress) {
+		RequestAddinShmemSpace(fuzz_shmem_size());
+		RequestNamedLWLockTranche("fuzz", 1);
+		prev_shmem_startup_hook = shmem_startup_hook;
+		shmem_startup_hook = fuzz_shmem_startup;
+	}
+}
+
+void fuzz_worker_main(Datum main_arg);
+
+/* Types whose values we can build directly from the raw input bytes */
+static bool direct_arg_is_raw(Oid typid) {
+	switch (typid) {
+	case TEXTOID:
+	case VARCHAROID:
+	case BYTEAOID:
+	case JSONOID:
+	case CSTRINGOID:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/* Look up the I/O functions check_roundtrip() needs for argument i */
+static void setup_roundtrip(int i, Oid typid) {
+	RoundTripInfo *rt = &fuzz_roundtrip[i];
+	int16 typlen;
+	bool typbyval;
+	char typalign;
+	char typdelim;
+	Oid func;
+	bool isvarlena;
+
+	rt->typid = typid;
+	rt->failures = 0;
+	getTypeInputInfo(typid, &func, &rt->typioparam);
+	fmgr_info(func, &rt->input);
+	getTypeOutputInfo(typid, &func, &isvarlena);
+	fmgr_info(func, &rt->output);
+
+	/* Not every type has binary I/O, just skip that half for those */
+	rt->binary = false;
+	get_type_io_data(typid, IOFunc_send, &typlen, &typbyval, &typalign,
+					 &typdelim, &rt->typioparam, &func);
+	if (!OidIsValid(func))
+		return;
+	fmgr_info(func, &rt->send);
+	get_type_io_data(typid, IOFunc_receive, &typlen, &typbyval, &typalign,
+					 &typdelim, &rt->typioparam, &func);
+	if (!OidIsValid(func))
+		return;
+	fmgr_info(func, &rt->receive);
+	rt->binary = true;
+}
+
+/* Look up how to build each argument of the target from input bytes */
+static void setup_fuzz_args(int nargs, Oid *argtypes) {
+	int i;
+	Oid typinput;
+
+	if (nargs < 1 || nargs > FUZZ_MAX_ARGS)
+		elog(ERROR, "Target to fuzz must take between 1 and %d parameters",
+			 FUZZ_MAX_ARGS);
+
+	fuzz_nargs = nargs;
+	for (i = 0; i < nargs; i++) {
+		fuzz_argtypes[i] = argtypes[i];
+		if (direct_arg_is_raw(argtypes[i]))
+			continue;
+		getTypeInputInfo(argtypes[i], &typinput, &fuzz_typioparams[i]);
+		fmgr_info(typinput, &fuzz_input_flinfo[i]);
+		if (fuzz_check_roundtrip)
+			setup_roundtrip(i, argtypes[i]);
+	}
+}
+
+/* Report a failed round trip check of argument i, see fuzz.roundtrip */
+static void roundtrip_failed(int i, const char *message) {
+	RoundTripInfo *rt = &fuzz_roundtrip[i];
+
+	n_roundtrip++;
+	if (rt->failures++ > 0)
+		return;
+	fprintf(stderr, "Round trip of type %s failed: %s\n",
+			format_type_be(rt->typid), message);
+	errorcallback("roundtrip");
+}
+
+/*
+ * Check that a value parsed from the input is a fixed point of the
+ * output and input functions of its type, and that sending and
+ * receiving it gives back the same bytes.
+ */
+static void check_roundtrip(int i, Datum value) {
+	RoundTripInfo *rt = &fuzz_roundtrip[i];
+	char *out1, *out2;
+	bytea *sent1, *sent2;
+	StringInfoData buf;
+
+	out1 = OutputFunctionCall(&rt->output, value);
+	out2 = OutputFunctionCall(&rt->output,
+							  InputFunctionCall(&rt->input, out1,
+												rt->typioparam, -1));
+	if (strcmp(out1, out2) != 0) {
+		roundtrip_failed(i, psprintf("output/input gave \"%s\", then \"%s\"",
+									 out1, out2));
+		return;
+	}
+
+	if (!rt->binary)
+		return;
+
+	sent1 = SendFunctionCall(&rt->send, value);
+	initStringInfo(&buf);
+	appendBinaryStringInfo(&buf, VARDATA(sent1), VARSIZE(sent1) - VARHDRSZ);
+	value = ReceiveFunctionCall(&rt->receive, &buf, rt->typioparam, -1);
+	if (buf.cursor != buf.len) {
+		roundtrip_failed(i, "receive did not consume its own send output");
+		return;
+	}
+	sent2 = SendFunctionCall(&rt->send, value);
+	if (VARSIZE(sent1) != VARSIZE(sent2) ||
+		memcmp(VARDATA(sent1), VARDATA(sent2), VARSIZE(sent1) - VARHDRSZ) != 0)
+		roundtrip_failed(i, psprintf("send/receive is not stable for \"%s\"",
+									 out1));
+}
+
 void fuzz_exit_handler(int code, Datum arg) {
 	//	if (in_fuzzer)
 		//		abort();
@@ -102,121 +419,1367 @@ test_fuzz_environment(PG_FUNCTION_ARGS){
    FuzzOne n=65536  success=0  fail=65536  null=0
    Error codes seen 42601:60539 42704:3460 22023:166 3F000:242 22P02:194 0A000:24 22003:80 22021:476 22025:355
 
+   The query may take several parameters of any type. The parser
+   infers their types, and each input is split into one slice per
+   parameter, see unpack_fuzz_args().
+
+   An optional third argument runs up to that many consecutive inputs
+   inside one subtransaction, which is only rolled back when an input
+   errors out. The query is executed read-only so nothing the other
+   inputs in the batch did is lost by the rollback:
+
+   CREATE FUNCTION fuzz(runs integer, expr text, batch_size integer DEFAULT 1)
+     RETURNS void AS 'test.so' LANGUAGE C STRICT;
+
 */
 
-PG_FUNCTION_INFO_V1(fuzz);
-Datum
-fuzz(PG_FUNCTION_ARGS)
-{
-	unsigned runs = PG_GETARG_INT32(0);
-	text *expr_text = PG_GETARG_TEXT_P(1);
-	char *expr = text_to_cstring(expr_text);
-	Oid argtypes[1] = { TEXTOID };
-	int retval;
-	static unsigned ever_called_before = 0;
+static void check_fuzz_limits(unsigned runs, int batch) {
+	if (runs > 400000000)
+		elog(ERROR, "Unreasonable number of runs");
 
-	if (ever_called_before++) {
-		elog(ERROR, "Fuzzer can only be used once, reconnect to a new process to run again");
-	}
+	if (batch < 1 || batch > 100000)
+		elog(ERROR, "Unreasonable batch size");
+}
+
+/* An input that errors out rolls back the whole batch it is in, and with
+ * it whatever the inputs before it did. That is only harmless for targets
+ * that can't do anything, like the read-only queries of fuzz() */
+static void check_batch_target(Oid funcoid, int batch) {
+	if (batch > 1 && func_volatile(funcoid) == PROVOLATILE_VOLATILE)
+		elog(ERROR, "Volatile function %s cannot be fuzzed in batches",
+			 format_procedure(funcoid));
+}
+
+/* Checks and setup shared by all the fuzz entry points. target names
+ * what is being fuzzed in fuzz.corpus_table */
+static void begin_fuzz_session(unsigned runs, int batch, const char *target) {
+	static bool exit_handler_registered = false;
+
+	if (in_fuzzer)
+		elog(ERROR, "Fuzzer is already running in this backend");
+
+	/* Whatever an earlier session that errored out didn't free went away
+	 * with the memory of the query it ran in */
+	fuzz_call_context = NULL;
+	fuzz_recv_buf.data = NULL;
 
 	if (atoi(GetConfigOptionByName("max_stack_depth", NULL, false)) < 7680) {
 		elog(WARNING, "setting max_stack_depth");
 		SetConfigOption("max_stack_depth", "7680", PGC_SUSET, PGC_S_OVERRIDE);
 	}
 
-	if (runs > 400000000)
-		elog(ERROR, "Unreasonable number of runs");
+	check_fuzz_limits(runs, batch);
 
 	limit_resources();
 
 	/* If Postgres handles a FATAL error it'll exit cleanly but we
 	 * want to treat the last test as a failure */
-	on_proc_exit(fuzz_exit_handler, 0);
+	if (!exit_handler_registered) {
+		on_proc_exit(fuzz_exit_handler, 0);
+		exit_handler_registered = true;
+	}
+
+	/* Each call is a fresh fuzzing session as far as FuzzOne is concerned */
+	reset_fuzz_stats();
+	batch_size = batch;
+	fuzz_mode = FUZZ_PLAN;
+	fuzz_check_roundtrip = fuzz_roundtrip_guc;
+
+	fuzz_corpus_table = NULL;
+	if (fuzz_corpus_table_guc && fuzz_corpus_table_guc[0]) {
+		List *names = stringToQualifiedNameList(fuzz_corpus_table_guc);
+
+		fuzz_corpus_table = NameListToQuotedString(names);
+		fuzz_corpus_target = pstrdup(target);
+		fuzz_corpus_spool_prefix =
+			psprintf("%u-%u-", MyDatabaseId,
+					 RangeVarGetRelid(makeRangeVarFromNameList(names),
+									  NoLock, false));
+		fuzz_corpus_spool_loaded = false;
+	}
+	if (fuzz_corpus_seen)
+		hash_destroy(fuzz_corpus_seen);
+	fuzz_corpus_seen = NULL;
+
+	fuzz_call_context = AllocSetContextCreate(CurrentMemoryContext,
+											  "fuzz call",
+											  ALLOCSET_DEFAULT_SIZES);
+}
+
+/* Free what begin_fuzz_session() and the entry points allocated for the
+ * session, also when it errored out half way */
+static void free_fuzz_session(void) {
+	if (fuzz_call_context)
+		MemoryContextDelete(fuzz_call_context);
+	fuzz_call_context = NULL;
+	if (fuzz_recv_buf.data)
+		pfree(fuzz_recv_buf.data);
+	fuzz_recv_buf.data = NULL;
+	if (fuzz_corpus_seen)
+		hash_destroy(fuzz_corpus_seen);
+	fuzz_corpus_seen = NULL;
+}
+
+/* A FATAL error in a fork server child costs just the input, but
+ * proc_exit() would go on to detach the parent's DSM segments */
+static void fuzz_child_proc_exit(int code, Datum arg) {
+	_exit(code);
+}
+
+/* Runs in each fork server child before its first input */
+static void fuzz_child_start(void) {
+	/* Our exit callbacks would release the parent's PGPROC and the
+	 * client connection is the parent's too */
+	on_exit_reset();
+	before_shmem_exit(fuzz_child_proc_exit, 0);
+	whereToSendOutput = DestNone;
+	MyProcPid = getpid();
+	fuzz_in_child = true;
+	/* An XID would be assigned in the parent's PGPROC */
+	XactReadOnly = true;
+	/* A batch the parent has open is the parent's, ours nest inside it */
+	batch_count = 0;
+}
+
+/* Runs in a fork server child that finished its batch, right before it
+ * exits without cleaning anything else up */
+static void fuzz_child_exit(void) {
+	release_batch();
+}
+
+/* Ends a fork server child on an error that would end the session in
+ * the backend, leaving the error for the parent to raise */
+static void fuzz_child_stop(ErrorData *edata, int code) {
+	fuzz_fork_stop->sqlerrcode = edata->sqlerrcode;
+	strlcpy(fuzz_fork_stop->message, edata->message ? edata->message : "",
+			sizeof(fuzz_fork_stop->message));
+	_exit(code);
+}
+
+/* Polled by the fork server while a child runs, so that the backend can
+ * still be cancelled and terminated */
+static bool fuzz_parent_should_stop(void) {
+	return QueryCancelPending || ProcDiePending ||
+		fuzz_fork_stop->sqlerrcode != 0;
+}
+
+static void run_fuzz_session(unsigned runs) {
+	/* Invoke the driver via the test_harness.cpp C++ code. If an error
+	 * escapes FuzzOne we longjmp straight past the driver's destructors
+	 * so make sure the fuzzer is reset before anyone else sees the error */
+
+	if (fuzz_fork_server_batch && !fuzz_fork_stop) {
+		fuzz_fork_stop = mmap(NULL, sizeof(FuzzForkStop),
+							  PROT_READ | PROT_WRITE,
+							  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (fuzz_fork_stop == MAP_FAILED) {
+			fuzz_fork_stop = NULL;
+			elog(ERROR, "could not map memory for the fork server: %m");
+		}
+	}
+
 	in_fuzzer = 1;
+	if (fuzz_fork_server_batch) {
+		memset(fuzz_fork_stop, 0, sizeof(FuzzForkStop));
+		SetFuzzForkServer(fuzz_fork_server_batch,
+						  fuzz_child_start, fuzz_child_exit,
+						  fuzz_parent_should_stop);
+	}
+	if (fuzz_corpus_table)
+		SetFuzzCorpusTable(1);
+	PG_TRY();
+	{
+		GoFuzz(runs, fuzz_mode == FUZZ_RECV);
+	}
+	PG_CATCH();
+	{
+		/* In a fork server child the error must not get any further,
+		 * see fuzz.fork_server_batch. It was raised outside FuzzOne or
+		 * in its recovery, so release what FuzzOne would have */
+		if (fuzz_in_child) {
+			MemoryContextSwitchTo(TopMemoryContext);
+			EmitErrorReport();
+			LWLockReleaseAll();
+			fuzz_child_stop(CopyErrorData(), 1);
+		}
+		ResetFuzzer();
+		in_fuzzer = 0;
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	release_batch();
+	free_fuzz_session();
+
+	if (n_roundtrip)
+		elog(WARNING, "%lu inputs failed round trip checks, see the roundtrip- files",
+			 n_roundtrip);
+
+	/* With several arguments the fuzzer should have found inputs that
+	 * give every one of them something, or the split isn't working */
+	if (fuzz_nargs > 1 && n_execs > n_null && n_empty_args == n_execs - n_null)
+		elog(WARNING, "No input gave all %d arguments a non-empty value",
+			 fuzz_nargs);
+
+	/* disable the proc_exit call which calls the deathcallback */
+	in_fuzzer = 0;
+
+	/* The fork server stops early for these, see fuzz_parent_should_stop() */
+	if (fuzz_fork_server_batch) {
+		CHECK_FOR_INTERRUPTS();
+		if (fuzz_fork_stop->sqlerrcode)
+			ereport(ERROR,
+					(errcode(fuzz_fork_stop->sqlerrcode),
+					 errmsg("%s", fuzz_fork_stop->message),
+					 errdetail("Raised in a fork server child.")));
+	}
+}
+
+/* Fuzz the parameters of query expr, for fuzz() and fuzz_parallel() */
+static void fuzz_query_session(char *expr, unsigned runs, int batch) {
+	List *parsetrees;
+	Oid *argtypes = NULL;
+	int nargs = 0;
+	int i;
+	int retval;
+
+	begin_fuzz_session(runs, batch, expr);
+
+	/* Let the parser work out what types the parameters are the same
+	 * way it does for an unnamed prepared statement. Parameters it
+	 * can't determine are passed as text as before */
+	parsetrees = pg_parse_query(expr);
+	if (list_length(parsetrees) != 1)
+		elog(ERROR, "Query to fuzz must be a single statement");
+	(void) parse_analyze_varparams((Node *) linitial(parsetrees), expr,
+								   &argtypes, &nargs);
+	for (i = 0; i < nargs; i++)
+		if (argtypes[i] == UNKNOWNOID || argtypes[i] == InvalidOid)
+			argtypes[i] = TEXTOID;
+	setup_fuzz_args(nargs, argtypes);
 
 	retval = SPI_connect();
 	if (retval != SPI_OK_CONNECT)
 		abort();
 
 	/* Prepare once before we start the driver */
-	plan = SPI_prepare(expr, 1, argtypes);
+	plan = SPI_prepare(expr, nargs, argtypes);
 	if (!plan)
 		elog(ERROR, "Failed to plan query");
 
-	retval = SPI_getargcount(plan);
-	if (retval != 1)
-		elog(ERROR, "Query to fuzz must take precisely one parameter");
+	run_fuzz_session(runs);
 
-	/* Invoke the driver via the test_harness.cpp C++ code */
+	SPI_finish();
+}
 
-	GoFuzz(runs);
+PG_FUNCTION_INFO_V1(fuzz);
+Datum
+fuzz(PG_FUNCTION_ARGS)
+{
+	unsigned runs = PG_GETARG_INT32(0);
+	text *expr_text = PG_GETARG_TEXT_P(1);
+	int batch = PG_NARGS() > 2 ? PG_GETARG_INT32(2) : 1;
 
-	SPI_finish();
+	fuzz_query_session(text_to_cstring(expr_text), runs, batch);
 
-	/* disable the proc_exit call which calls the deathcallback */
-	in_fuzzer = 0;
+	PG_RETURN_NULL();
+}
+
+/*
+   Parallel mode: run fuzz() on the same query in several background
+   workers at once. Instead of polling the corpus directory the workers
+   pass the inputs they find to each other through a ring in a DSM
+   segment (see Fuzzer/FuzzerSharedCorpus.h), along with the features
+   each input added so the others can skip ones that add nothing for
+   them. Each worker does runs runs and logs to the server log; the
+   calling backend just waits for them and stops them if it's cancelled.
+
+   CREATE FUNCTION fuzz_parallel(workers integer, runs integer, expr text,
+                                 batch_size integer DEFAULT 1)
+     RETURNS void AS 'test.so' LANGUAGE C STRICT;
+
+   select fuzz_parallel(4, 1000000, 'select $1::jsonb');
+*/
+
+/* Inputs are at most -max_len=32 bytes, see test_harness.cpp */
+#define FUZZ_SHARED_SLOTS 4096
+#define FUZZ_SHARED_UNIT_SIZE 256
+
+typedef struct FuzzParallelShared {
+	Oid database;
+	Oid user;
+	unsigned runs;
+	int batch;
+	bool roundtrip;
+	Size corpus_offset;		/* where the SharedCorpus starts */
+	Size corpus_table_offset;	/* of fuzz.corpus_table, after expr */
+	char expr[FLEXIBLE_ARRAY_MEMBER];
+} FuzzParallelShared;
+
+/* The workers need to load the same library fuzz_parallel() is in */
+static char *get_func_library(Oid fn_oid) {
+	HeapTuple tuple;
+	Datum probin;
+	bool isnull;
+	char *result;
+
+	tuple = SearchSysCache1(PROCOID, ObjectIdGetDatum(fn_oid));
+	if (!HeapTupleIsValid(tuple))
+		elog(ERROR, "cache lookup failed for function %u", fn_oid);
+	probin = SysCacheGetAttr(PROCOID, tuple, Anum_pg_proc_probin, &isnull);
+	if (isnull)
+		elog(ERROR, "null probin for function %u", fn_oid);
+	result = TextDatumGetCString(probin);
+	ReleaseSysCache(tuple);
+
+	return result;
+}
+
+PG_FUNCTION_INFO_V1(fuzz_parallel);
+Datum
+fuzz_parallel(PG_FUNCTION_ARGS)
+{
+	int nworkers = PG_GETARG_INT32(0);
+	unsigned runs = PG_GETARG_INT32(1);
+	char *expr = text_to_cstring(PG_GETARG_TEXT_P(2));
+	int batch = PG_NARGS() > 3 ? PG_GETARG_INT32(3) : 1;
+	Size expr_size = strlen(expr) + 1;
+	char *corpus_table = fuzz_corpus_table_guc ? fuzz_corpus_table_guc : "";
+	Size corpus_table_size = strlen(corpus_table) + 1;
+	Size corpus_offset;
+	char *library;
+	dsm_segment *seg;
+	FuzzParallelShared *shared;
+	BackgroundWorker worker;
+	BackgroundWorkerHandle **handles;
+	int nlaunched = 0;
+	int i;
+
+	if (nworkers < 1 || nworkers > max_worker_processes)
+		elog(ERROR, "Unreasonable number of workers");
+	check_fuzz_limits(runs, batch);
+
+	library = get_func_library(fcinfo->flinfo->fn_oid);
+	if (strlen(library) >= BGW_MAXLEN)
+		elog(ERROR, "Library path \"%s\" is too long for a background worker",
+			 library);
+
+	corpus_offset = MAXALIGN(offsetof(FuzzParallelShared, expr) +
+							 expr_size + corpus_table_size);
+	seg = dsm_create(corpus_offset +
+					 SharedCorpusSize(FUZZ_SHARED_SLOTS, FUZZ_SHARED_UNIT_SIZE),
+					 0);
+	shared = dsm_segment_address(seg);
+	shared->database = MyDatabaseId;
+	shared->user = GetUserId();
+	shared->runs = runs;
+	shared->batch = batch;
+	shared->roundtrip = fuzz_roundtrip_guc;
+	shared->corpus_offset = corpus_offset;
+	memcpy(shared->expr, expr, expr_size);
+	shared->corpus_table_offset = expr_size;
+	memcpy(shared->expr + expr_size, corpus_table, corpus_table_size);
+	CreateSharedCorpus((char *) shared + corpus_offset,
+					   FUZZ_SHARED_SLOTS, FUZZ_SHARED_UNIT_SIZE);
+
+	memset(&worker, 0, sizeof(worker));
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS |
+		BGWORKER_BACKEND_DATABASE_CONNECTION;
+	worker.bgw_start_time = BgWorkerStart_ConsistentState;
+	worker.bgw_restart_time = BGW_NEVER_RESTART;
+	strlcpy(worker.bgw_library_name, library, BGW_MAXLEN);
+	strlcpy(worker.bgw_function_name, "fuzz_worker_main", BGW_MAXLEN);
+	worker.bgw_main_arg = UInt32GetDatum(dsm_segment_handle(seg));
+	worker.bgw_notify_pid = MyProcPid;
+
+	handles = palloc(nworkers * sizeof(BackgroundWorkerHandle *));
+	for (i = 0; i < nworkers; i++) {
+		snprintf(worker.bgw_name, BGW_MAXLEN, "fuzz worker %d", i);
+		if (!RegisterDynamicBackgroundWorker(&worker, &handles[nlaunched]))
+			break;
+		nlaunched++;
+	}
+	if (nlaunched == 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_RESOURCES),
+				 errmsg("could not register fuzz workers"),
+				 errhint("You may need to increase max_worker_processes.")));
+	if (nlaunched < nworkers)
+		elog(WARNING, "only %d of %d fuzz workers could be registered",
+			 nlaunched, nworkers);
+
+	PG_TRY();
+	{
+		for (i = 0; i < nlaunched; i++)
+			WaitForBackgroundWorkerShutdown(handles[i]);
+	}
+	PG_CATCH();
+	{
+		for (i = 0; i < nlaunched; i++)
+			TerminateBackgroundWorker(handles[i]);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	dsm_detach(seg);
 
 	PG_RETURN_NULL();
-}		
+}
+
+void
+fuzz_worker_main(Datum main_arg)
+{
+	dsm_segment *seg;
+	FuzzParallelShared *shared;
+
+	BackgroundWorkerUnblockSignals();
+
+	CurrentResourceOwner = ResourceOwnerCreate(NULL, "fuzz worker");
+	seg = dsm_attach(DatumGetUInt32(main_arg));
+	if (!seg)
+		elog(ERROR, "could not map dynamic shared memory segment");
+	shared = dsm_segment_address(seg);
+
+	BackgroundWorkerInitializeConnectionByOid(shared->database, shared->user);
+
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+	PushActiveSnapshot(GetTransactionSnapshot());
+
+	fuzz_roundtrip_guc = shared->roundtrip;
+	fuzz_corpus_table_guc = shared->expr + shared->corpus_table_offset;
+	SetFuzzSharedCorpus((char *) shared + shared->corpus_offset);
+	fuzz_query_session(shared->expr, shared->runs, shared->batch);
+
+	PopActiveSnapshot();
+	CommitTransactionCommand();
+
+	dsm_detach(seg);
+	proc_exit(0);
+}
+
+/*
+   Direct mode: call a function through fmgr for each input, skipping
+   SPI, the planner and the executor entirely. The FmgrInfo and
+   FunctionCallInfo are set up once per session. Arguments are unpacked
+   from the input the same way as query parameters are for fuzz().
+   Only functions that aren't volatile can be run in batches, as their
+   side effects would be lost along with a batch that is rolled back.
+
+   CREATE FUNCTION fuzz_function(runs integer, func regprocedure,
+                                 batch_size integer DEFAULT 1)
+     RETURNS void AS 'test.so' LANGUAGE C STRICT;
+
+   select fuzz_function(100000, 'to_tsvector(text)');
+*/
+
+PG_FUNCTION_INFO_V1(fuzz_function);
+Datum
+fuzz_function(PG_FUNCTION_ARGS)
+{
+	unsigned runs = PG_GETARG_INT32(0);
+	Oid funcoid = PG_GETARG_OID(1);
+	int batch = PG_NARGS() > 2 ? PG_GETARG_INT32(2) : 1;
+	Oid *argtypes;
+	int nargs;
+
+	begin_fuzz_session(runs, batch, format_procedure(funcoid));
+
+	get_func_signature(funcoid, &argtypes, &nargs);
+	if (get_func_retset(funcoid))
+		elog(ERROR, "Cannot fuzz set-returning functions directly");
+	setup_fuzz_args(nargs, argtypes);
+	check_batch_target(funcoid, batch);
+
+	fmgr_info(funcoid, &fuzz_flinfo);
+	InitFunctionCallInfoData(fuzz_fcinfo, &fuzz_flinfo, nargs,
+							 DEFAULT_COLLATION_OID, NULL, NULL);
+	fuzz_mode = FUZZ_FUNCTION;
+
+	run_fuzz_session(runs);
+
+	PG_RETURN_NULL();
+}
+
+/*
+   Receive mode: feed each input as binary wire data to a type's
+   typreceive function, called directly through fmgr like the server
+   does for binary Bind parameters. The input is copied into a single
+   StringInfo buffer that is reused for the whole session; it has to be
+   copied rather than pointed at because receive functions rely on the
+   buffer being NUL terminated, as it is when it comes off the wire.
+
+   CREATE FUNCTION fuzz_recv(type regtype, runs integer,
+                             batch_size integer DEFAULT 1)
+     RETURNS void AS 'test.so' LANGUAGE C STRICT;
+   CREATE FUNCTION fuzz_recv_all(runs integer)
+     RETURNS void AS 'test.so' LANGUAGE C STRICT;
+
+   fuzz_recv_all() sweeps through the receive functions of every type
+   in pg_type, spending the given number of runs on each.
+*/
+
+static void fuzz_recv_session(Oid typid, unsigned runs, int batch) {
+	Oid typreceive;
+	Oid typioparam;
+
+	begin_fuzz_session(runs, batch,
+					   psprintf("recv %s", format_type_be(typid)));
+
+	getTypeBinaryInputInfo(typid, &typreceive, &typioparam);
+	check_batch_target(typreceive, batch);
+	fmgr_info(typreceive, &fuzz_flinfo);
+	InitFunctionCallInfoData(fuzz_fcinfo, &fuzz_flinfo, 3,
+							 InvalidOid, NULL, NULL);
+	initStringInfo(&fuzz_recv_buf);
+	fuzz_fcinfo.arg[0] = PointerGetDatum(&fuzz_recv_buf);
+	fuzz_fcinfo.arg[1] = ObjectIdGetDatum(typioparam);
+	fuzz_fcinfo.arg[2] = Int32GetDatum(-1);
+	fuzz_fcinfo.argnull[0] = false;
+	fuzz_fcinfo.argnull[1] = false;
+	fuzz_fcinfo.argnull[2] = false;
+	fuzz_nargs = 0;
+	fuzz_mode = FUZZ_RECV;
+	if (fuzz_check_roundtrip)
+		setup_roundtrip(0, typid);
+
+	run_fuzz_session(runs);
+}
+
+PG_FUNCTION_INFO_V1(fuzz_recv);
+Datum
+fuzz_recv(PG_FUNCTION_ARGS)
+{
+	Oid typid = PG_GETARG_OID(0);
+	unsigned runs = PG_GETARG_INT32(1);
+	int batch = PG_NARGS() > 2 ? PG_GETARG_INT32(2) : 1;
 
-static struct {
-	int errcode;
-	int count;
-} errcode_counts[100];
-int num_counts;
+	fuzz_recv_session(typid, runs, batch);
 
-static int inc_errcode_count(int errcode) {
+	PG_RETURN_NULL();
+}
+
+PG_FUNCTION_INFO_V1(fuzz_recv_all);
+Datum
+fuzz_recv_all(PG_FUNCTION_ARGS)
+{
+	unsigned runs = PG_GETARG_INT32(0);
+	MemoryContext oldcontext = CurrentMemoryContext;
+	ResourceOwner oldowner = CurrentResourceOwner;
+	Oid *types;
+	int ntypes;
 	int i;
-	for (i=0;i<num_counts;i++) {
-		if (errcode_counts[i].errcode == errcode) {
-			return ++errcode_counts[i].count;
+
+	/* Collect the types up front, fuzzing them doesn't need SPI */
+	if (SPI_connect() != SPI_OK_CONNECT)
+		abort();
+	if (SPI_execute("SELECT oid FROM pg_type"
+					" WHERE typisdefined AND typreceive <> 0"
+					" ORDER BY oid", true, 0) != SPI_OK_SELECT)
+		elog(ERROR, "Failed to list types with receive functions");
+	ntypes = SPI_processed;
+	types = (Oid *) SPI_palloc(ntypes * sizeof(Oid));
+	for (i = 0; i < ntypes; i++) {
+		bool isnull;
+		types[i] = DatumGetObjectId(SPI_getbinval(SPI_tuptable->vals[i],
+												  SPI_tuptable->tupdesc,
+												  1, &isnull));
+	}
+	SPI_finish();
+
+	/* Run each type in its own subtransaction so that a type whose
+	 * session errors out doesn't end the whole sweep */
+	for (i = 0; i < ntypes; i++) {
+		char *typname = format_type_be(types[i]);
+
+		elog(INFO, "fuzzing receive function of %s", typname);
+
+		BeginInternalSubTransaction(NULL);
+		MemoryContextSwitchTo(oldcontext);
+		PG_TRY();
+		{
+			fuzz_recv_session(types[i], runs, 1);
+
+			ReleaseCurrentSubTransaction();
+			MemoryContextSwitchTo(oldcontext);
+			CurrentResourceOwner = oldowner;
+		}
+		PG_CATCH();
+		{
+			ErrorData *edata;
+
+			MemoryContextSwitchTo(oldcontext);
+			edata = CopyErrorData();
+
+			/* Allow C-c to cancel the whole sweep */
+			if (edata->sqlerrcode == ERRCODE_QUERY_CANCELED)
+				PG_RE_THROW();
+
+			FlushErrorState();
+			RollbackAndReleaseCurrentSubTransaction();
+			MemoryContextSwitchTo(oldcontext);
+			CurrentResourceOwner = oldowner;
+
+			/* These live in our context, not the subtransaction's */
+			free_fuzz_session();
+
+			elog(WARNING, "fuzzing %s stopped: %s", typname, edata->message);
+			FreeErrorData(edata);
+		}
+		PG_END_TRY();
+	}
+
+	PG_RETURN_NULL();
+}
+
+/*
+ * Errors are counted per SQLSTATE and message template, i.e. the format
+ * string before translation and formatting, so "invalid input syntax for
+ * type %s" is one entry however many types and inputs it came from. The
+ * pid is part of the key so that the shared table can hold the counts of
+ * every fuzzing backend; the local table only ever has our own.
+ */
+#define FUZZ_ERROR_MESSAGE_LEN 128
+#define FUZZ_INPUT_HASH_LEN 41		/* SHA1 in hex, like the corpus files */
+#define FUZZ_MAX_SHARED_ERRORS 4096
+
+typedef struct FuzzErrorKey {
+	int pid;
+	int sqlerrcode;
+	uint32 template_hash;
+} FuzzErrorKey;
+
+typedef struct SharedErrorStat {
+	FuzzErrorKey key;
+	pg_atomic_uint64 count;
+	char message[FUZZ_ERROR_MESSAGE_LEN];
+	char first_input[FUZZ_INPUT_HASH_LEN];
+} SharedErrorStat;
+
+typedef struct LocalErrorStat {
+	FuzzErrorKey key;
+	uint64 count;
+	char message[FUZZ_ERROR_MESSAGE_LEN];
+	char first_input[FUZZ_INPUT_HASH_LEN];
+	SharedErrorStat *shared;	/* our entry in shared memory, if any */
+} LocalErrorStat;
+
+static HTAB *local_error_stats;
+
+/* Only there if we're in shared_preload_libraries */
+typedef struct FuzzSharedState {
+	LWLock *lock;				/* protects the set of shared entries */
+} FuzzSharedState;
+
+static FuzzSharedState *fuzz_shared;
+static HTAB *fuzz_shared_error_stats;
+
+static Size fuzz_shmem_size(void) {
+	return add_size(MAXALIGN(sizeof(FuzzSharedState)),
+					hash_estimate_size(FUZZ_MAX_SHARED_ERRORS,
+									   sizeof(SharedErrorStat)));
+}
+
+static void fuzz_shmem_startup(void) {
+	HASHCTL info;
+	bool found;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+	fuzz_shared = ShmemInitStruct("fuzz", sizeof(FuzzSharedState), &found);
+	if (!found)
+		fuzz_shared->lock = &(GetNamedLWLockTranche("fuzz"))->lock;
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(FuzzErrorKey);
+	info.entrysize = sizeof(SharedErrorStat);
+	fuzz_shared_error_stats = ShmemInitHash("fuzz error stats",
+											FUZZ_MAX_SHARED_ERRORS,
+											FUZZ_MAX_SHARED_ERRORS,
+											&info,
+											HASH_ELEM | HASH_BLOBS);
+	LWLockRelease(AddinShmemInitLock);
+}
+
+/* Drop our entries from the shared table */
+static void forget_shared_error_stats(int code, Datum arg) {
+	HASH_SEQ_STATUS status;
+	SharedErrorStat *stat;
+
+	LWLockAcquire(fuzz_shared->lock, LW_EXCLUSIVE);
+	hash_seq_init(&status, fuzz_shared_error_stats);
+	while ((stat = hash_seq_search(&status)) != NULL)
+		if (stat->key.pid == MyProc->pid)
+			hash_search(fuzz_shared_error_stats, &stat->key, HASH_REMOVE, NULL);
+	LWLockRelease(fuzz_shared->lock);
+}
+
+static void reset_error_stats() {
+	static bool exit_callback_registered = false;
+	HASHCTL info;
+
+	if (local_error_stats)
+		hash_destroy(local_error_stats);
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(FuzzErrorKey);
+	info.entrysize = sizeof(LocalErrorStat);
+	local_error_stats = hash_create("fuzz error stats", 256, &info,
+									HASH_ELEM | HASH_BLOBS);
+
+	if (!fuzz_shared)
+		return;
+	forget_shared_error_stats(0, 0);
+	if (!exit_callback_registered) {
+		before_shmem_exit(forget_shared_error_stats, 0);
+		exit_callback_registered = true;
+	}
+}
+
+static void reset_fuzz_stats() {
+	n_execs = n_success = n_fail = n_null = 0;
+	n_empty_args = 0;
+	n_roundtrip = 0;
+	last_error = last_error_count = 0;
+	reset_error_stats();
+	batch_count = 0;
+}
+
+/* Commit the subtransaction the current batch of inputs ran in, if any */
+static void release_batch() {
+	MemoryContext oldcontext = CurrentMemoryContext;
+	ResourceOwner oldowner = CurrentResourceOwner;
+
+	if (!batch_count)
+		return;
+
+	/* A fork server child must not commit, see fuzz.fork_server_batch */
+	if (fuzz_in_child)
+		RollbackAndReleaseCurrentSubTransaction();
+	else
+		ReleaseCurrentSubTransaction();
+	MemoryContextSwitchTo(oldcontext);
+	CurrentResourceOwner = oldowner;
+	/* Only fuzz() runs its inputs through an SPI connection of its own */
+	if (fuzz_mode == FUZZ_PLAN)
+		SPI_restore_connection();
+	batch_count = 0;
+}
+
+/*
+   The corpus table, see fuzz.corpus_table. Each input is a row; the
+   table may hold the corpora of any number of targets:
+
+   CREATE TABLE fuzz_corpus (
+     id bigserial PRIMARY KEY,
+     target text NOT NULL,	-- the query, function or "recv <type>"
+     sha1 text NOT NULL,	-- what libFuzzer would name the file
+     unit bytea NOT NULL,
+     num_features integer NOT NULL,	-- new features it had, 0 if unknown
+     added timestamptz NOT NULL DEFAULT now()
+   );
+   CREATE INDEX ON fuzz_corpus (target, sha1);
+
+   SET fuzz.corpus_table = 'fuzz_corpus';
+   select fuzz(1000000, 'select $1::jsonb');
+
+   The index is deliberately not unique: an insert into a unique index
+   waits for any uncommitted insert of the same key, and fuzz_parallel()
+   workers only commit when they are done. Two sessions may therefore
+   both add the same input now and then, which does no harm. Rows are
+   only visible to other sessions once the fuzz() call that added them
+   commits, whatever their id. Inputs that never added much are easy to
+   prune:
+
+   DELETE FROM fuzz_corpus WHERE num_features < 2
+     AND added < now() - interval '1 week';
+*/
+
+/*
+ * The rows are inserted in the transaction of the fuzz() call, so every
+ * input is also spooled to a file of its own here first. The files are
+ * removed once a transaction that inserted them commits; the first
+ * ReadCorpusTable() of a session loads whatever a rolled back or crashed
+ * session left behind.
+ */
+#define FUZZ_CORPUS_SPOOL "/var/tmp/corpus-spool"
+
+typedef struct SpooledUnit {
+	char	   *path;
+	SubTransactionId subid;		/* subtransaction that inserted the row */
+} SpooledUnit;
+
+/* Spool files to remove when the transaction commits, in TopMemoryContext */
+static List *fuzz_corpus_spooled = NIL;
+
+static void corpus_spool_xact_callback(XactEvent event, void *arg) {
+	ListCell *lc;
+
+	if (event != XACT_EVENT_COMMIT && event != XACT_EVENT_ABORT &&
+		event != XACT_EVENT_PARALLEL_COMMIT &&
+		event != XACT_EVENT_PARALLEL_ABORT)
+		return;
+	foreach(lc, fuzz_corpus_spooled) {
+		SpooledUnit *unit = lfirst(lc);
+
+		if (event == XACT_EVENT_COMMIT || event == XACT_EVENT_PARALLEL_COMMIT) {
+			if (unlink(unit->path) < 0 && errno != ENOENT)
+				elog(WARNING, "could not remove file \"%s\": %m", unit->path);
 		}
+		pfree(unit->path);
 	}
-	if (num_counts >= 100)
+	list_free_deep(fuzz_corpus_spooled);
+	fuzz_corpus_spooled = NIL;
+}
+
+static void corpus_spool_subxact_callback(SubXactEvent event,
+										  SubTransactionId mySubid,
+										  SubTransactionId parentSubid,
+										  void *arg) {
+	List *keep = NIL;
+	ListCell *lc;
+	MemoryContext oldcontext;
+
+	if (event != SUBXACT_EVENT_COMMIT_SUB && event != SUBXACT_EVENT_ABORT_SUB)
+		return;
+	oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+	foreach(lc, fuzz_corpus_spooled) {
+		SpooledUnit *unit = lfirst(lc);
+
+		if (unit->subid == mySubid) {
+			/* The row went away with the subtransaction, keep the file */
+			if (event == SUBXACT_EVENT_ABORT_SUB) {
+				pfree(unit->path);
+				pfree(unit);
+				continue;
+			}
+			unit->subid = parentSubid;
+		}
+		keep = lappend(keep, unit);
+	}
+	list_free(fuzz_corpus_spooled);
+	fuzz_corpus_spooled = keep;
+	MemoryContextSwitchTo(oldcontext);
+}
+
+/* Remove the spool file at path once the current (sub)transaction's
+ * insert of it commits */
+static void remember_spooled(const char *path) {
+	static bool callbacks_registered = false;
+	MemoryContext oldcontext;
+	SpooledUnit *unit;
+
+	if (!callbacks_registered) {
+		RegisterXactCallback(corpus_spool_xact_callback, NULL);
+		RegisterSubXactCallback(corpus_spool_subxact_callback, NULL);
+		callbacks_registered = true;
+	}
+	oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+	unit = palloc(sizeof(SpooledUnit));
+	unit->path = pstrdup(path);
+	unit->subid = GetCurrentSubTransactionId();
+	fuzz_corpus_spooled = lappend(fuzz_corpus_spooled, unit);
+	MemoryContextSwitchTo(oldcontext);
+}
+
+/* Returns whether the session already has the input with this SHA1 and
+ * remembers that it has it now */
+static bool corpus_unit_seen(const char *sha1) {
+	char key[FUZZ_INPUT_HASH_LEN];
+	bool found;
+
+	if (!fuzz_corpus_seen) {
+		HASHCTL info;
+
+		memset(&info, 0, sizeof(info));
+		info.keysize = FUZZ_INPUT_HASH_LEN;
+		info.entrysize = FUZZ_INPUT_HASH_LEN;
+		info.hcxt = TopMemoryContext;
+		fuzz_corpus_seen = hash_create("fuzz corpus seen", 1024, &info,
+									   HASH_ELEM | HASH_CONTEXT);
+	}
+	strlcpy(key, sha1, sizeof(key));
+	hash_search(fuzz_corpus_seen, key, HASH_ENTER, &found);
+	return found;
+}
+
+/* Adds an input to target in the corpus table unless an input with the
+ * same hash is already there. Needs an SPI connection. */
+static void insert_corpus_row(const char *target, const char *sha1,
+							  const uint8_t *data, size_t size,
+							  int num_features) {
+	StringInfoData sql;
+	Oid argtypes[4] = {TEXTOID, TEXTOID, BYTEAOID, INT4OID};
+	Datum values[4];
+	bytea *unit;
+
+	initStringInfo(&sql);
+	appendStringInfo(&sql,
+					 "INSERT INTO %s (target, sha1, unit, num_features)"
+					 " SELECT $1, $2, $3, $4 WHERE NOT EXISTS"
+					 " (SELECT 1 FROM %s WHERE target = $1 AND sha1 = $2)",
+					 fuzz_corpus_table, fuzz_corpus_table);
+	unit = palloc(size + VARHDRSZ);
+	SET_VARSIZE(unit, size + VARHDRSZ);
+	memcpy(VARDATA(unit), data, size);
+	values[0] = CStringGetTextDatum(target);
+	values[1] = CStringGetTextDatum(sha1);
+	values[2] = PointerGetDatum(unit);
+	values[3] = Int32GetDatum(num_features);
+	if (SPI_execute_with_args(sql.data, 4, argtypes, values, NULL,
+							  false, 0) != SPI_OK_INSERT)
+		elog(ERROR, "Failed to add input to %s", fuzz_corpus_table);
+}
+
+/*
+ * Spool files hold the number of features on a line of its own, the
+ * target with a terminating NUL and then the input. Returns false if the
+ * file is malformed or gone, as it is once the session that wrote it
+ * commits.
+ */
+static bool read_spooled_unit(const char *path, StringInfo buf,
+							  char **target, int *num_features,
+							  const uint8_t **data, size_t *size) {
+	FILE *file;
+	char chunk[1024];
+	size_t nread;
+	char *nl, *end;
+
+	file = AllocateFile(path, PG_BINARY_R);
+	if (!file) {
+		if (errno == ENOENT)
+			return false;
+		elog(ERROR, "could not open file \"%s\": %m", path);
+	}
+	resetStringInfo(buf);
+	while ((nread = fread(chunk, 1, sizeof(chunk), file)) > 0)
+		appendBinaryStringInfo(buf, chunk, nread);
+	if (ferror(file))
+		elog(ERROR, "could not read file \"%s\": %m", path);
+	FreeFile(file);
+
+	nl = memchr(buf->data, '\n', buf->len);
+	end = nl ? memchr(nl + 1, '\0', buf->len - (nl + 1 - buf->data)) : NULL;
+	if (!end) {
+		elog(WARNING, "Ignoring malformed corpus spool file \"%s\"", path);
+		return false;
+	}
+	*num_features = atoi(buf->data);
+	*target = nl + 1;
+	*data = (const uint8_t *) end + 1;
+	*size = buf->len - (end + 1 - buf->data);
+	return true;
+}
+
+/* Loads the spool files of the session's table, passing the inputs of
+ * its target to add_unit. Needs an SPI connection. */
+static void load_corpus_spool(void (*add_unit)(void *arg,
+											   const uint8_t *data,
+											   size_t size),
+							  void *arg) {
+	size_t prefix_len = strlen(fuzz_corpus_spool_prefix);
+	StringInfoData buf;
+	DIR *dir;
+	struct dirent *de;
+
+	dir = AllocateDir(FUZZ_CORPUS_SPOOL);
+	if (!dir && errno == ENOENT)
+		return;
+	initStringInfo(&buf);
+	while ((de = ReadDir(dir, FUZZ_CORPUS_SPOOL)) != NULL) {
+		char path[MAXPGPATH];
+		char sha1[FUZZ_INPUT_HASH_LEN];
+		char *target;
+		int num_features;
+		const uint8_t *data;
+		size_t size;
+
+		/* Files being written end in .tmp */
+		if (strncmp(de->d_name, fuzz_corpus_spool_prefix, prefix_len) != 0 ||
+			strchr(de->d_name, '.'))
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", FUZZ_CORPUS_SPOOL, de->d_name);
+		if (!read_spooled_unit(path, &buf, &target, &num_features,
+							   &data, &size))
+			continue;
+
+		InputHash(data, size, sha1);
+		insert_corpus_row(target, sha1, data, size, num_features);
+		remember_spooled(path);
+		if (strcmp(target, fuzz_corpus_target) == 0 && !corpus_unit_seen(sha1))
+			add_unit(arg, data, size);
+	}
+	FreeDir(dir);
+	pfree(buf.data);
+}
+
+/* Calls add_unit for every input of the session's target in the corpus
+ * table it doesn't have yet */
+void ReadCorpusTable(void (*add_unit)(void *arg, const uint8_t *data,
+									  size_t size),
+					 void *arg) {
+	StringInfoData sql;
+	Oid argtypes[1] = {TEXTOID};
+	Datum values[1];
+	bool pushed;
+	uint64 i;
+
+	/* A batch subtransaction can't outlive the nested SPI connection */
+	release_batch();
+	pushed = SPI_push_conditional();
+	if (SPI_connect() != SPI_OK_CONNECT)
 		abort();
-	errcode_counts[num_counts].errcode = errcode;
-	errcode_counts[num_counts].count = 1;
-	num_counts++;
-	return 1;
+
+	if (!fuzz_corpus_spool_loaded) {
+		load_corpus_spool(add_unit, arg);
+		fuzz_corpus_spool_loaded = true;
+	}
+
+	/* Rows don't become visible in id order, so this can't just ask for
+	 * the ones after the last id it saw */
+	initStringInfo(&sql);
+	appendStringInfo(&sql,
+					 "SELECT sha1, unit FROM %s WHERE target = $1",
+					 fuzz_corpus_table);
+	values[0] = CStringGetTextDatum(fuzz_corpus_target);
+	if (SPI_execute_with_args(sql.data, 1, argtypes, values, NULL,
+							  true, 0) != SPI_OK_SELECT)
+		elog(ERROR, "Failed to read corpus from %s", fuzz_corpus_table);
+
+	for (i = 0; i < SPI_processed; i++) {
+		HeapTuple tuple = SPI_tuptable->vals[i];
+		TupleDesc tupdesc = SPI_tuptable->tupdesc;
+		char *sha1;
+		bool isnull;
+		Datum unit;
+
+		sha1 = SPI_getvalue(tuple, tupdesc, 1);
+		unit = SPI_getbinval(tuple, tupdesc, 2, &isnull);
+		if (sha1 && !isnull && !corpus_unit_seen(sha1)) {
+			bytea *b = DatumGetByteaPP(unit);
+
+			add_unit(arg, (const uint8_t *) VARDATA_ANY(b),
+					 VARSIZE_ANY_EXHDR(b));
+		}
+	}
+
+	SPI_finish();
+	SPI_pop_conditional(pushed);
 }
-static void list_errcode_counts() {
-	int i;
-	fprintf(stderr, "Error codes seen");
-	for (i=0; i<num_counts; i++) {
-		fprintf(stderr, " %s:%d", unpack_sql_state(errcode_counts[i].errcode), errcode_counts[i].count);
+
+/* Adds an input to the session's target in the corpus table unless an
+ * input with the same hash is already there. The input is spooled first
+ * so that it isn't lost if the transaction doesn't commit. */
+void WriteCorpusTable(const uint8_t *data, size_t size, const char *sha1,
+					  size_t num_features) {
+	char path[MAXPGPATH];
+	char tmppath[MAXPGPATH];
+	char target_hash[FUZZ_INPUT_HASH_LEN];
+	FILE *file;
+	bool pushed;
+
+	corpus_unit_seen(sha1);
+
+	/* The target's hash keeps inputs of different targets apart */
+	InputHash((const uint8_t *) fuzz_corpus_target,
+			  strlen(fuzz_corpus_target), target_hash);
+	snprintf(path, sizeof(path), "%s/%s%s-%s", FUZZ_CORPUS_SPOOL,
+			 fuzz_corpus_spool_prefix, target_hash, sha1);
+	snprintf(tmppath, sizeof(tmppath), "%s.tmp", path);
+	if (mkdir(FUZZ_CORPUS_SPOOL, S_IRWXU) < 0 && errno != EEXIST)
+		elog(ERROR, "could not create directory \"%s\": %m",
+			 FUZZ_CORPUS_SPOOL);
+	file = AllocateFile(tmppath, PG_BINARY_W);
+	if (!file)
+		elog(ERROR, "could not create file \"%s\": %m", tmppath);
+	if (fprintf(file, "%d\n", (int) num_features) < 0 ||
+		fwrite(fuzz_corpus_target, 1, strlen(fuzz_corpus_target) + 1,
+			   file) != strlen(fuzz_corpus_target) + 1 ||
+		fwrite(data, 1, size, file) != size ||
+		FreeFile(file) != 0)
+		elog(ERROR, "could not write file \"%s\": %m", tmppath);
+	/* Sessions loading the spool must not see half written files */
+	if (rename(tmppath, path) < 0)
+		elog(ERROR, "could not rename file \"%s\": %m", tmppath);
+
+	release_batch();
+	pushed = SPI_push_conditional();
+	if (SPI_connect() != SPI_OK_CONNECT)
+		abort();
+
+	insert_corpus_row(fuzz_corpus_target, sha1, data, size,
+					  (int) num_features);
+	remember_spooled(path);
+
+	SPI_finish();
+	SPI_pop_conditional(pushed);
+}
+
+/* Count an error by SQLSTATE and message template and tell the fuzzer */
+static void count_error(ErrorData *edata, const char *Data, size_t Size) {
+	FuzzErrorKey key;
+	LocalErrorStat *stat;
+	bool found;
+	const char *msgid = edata->message_id ? edata->message_id : edata->message;
+
+	memset(&key, 0, sizeof(key));
+	/* Fork server children count under the backend's pid */
+	key.pid = MyProc->pid;
+	key.sqlerrcode = edata->sqlerrcode;
+	key.template_hash = msgid ?
+		DatumGetUInt32(hash_any((const unsigned char *) msgid,
+								strlen(msgid))) : 0;
+
+	/* New kinds of errors are new coverage as far as the fuzzer cares */
+	ErrorFeature(key.sqlerrcode, key.template_hash);
+
+	stat = hash_search(local_error_stats, &key, HASH_ENTER, &found);
+	if (found) {
+		stat->count++;
+		if (stat->shared)
+			pg_atomic_fetch_add_u64(&stat->shared->count, 1);
+		return;
+	}
+
+	/* First time we see this one, remember what it was and who hit it */
+	stat->count = 1;
+	strlcpy(stat->message, msgid ? msgid : "", FUZZ_ERROR_MESSAGE_LEN);
+	InputHash((const uint8_t *) Data, Size, stat->first_input);
+	stat->shared = NULL;
+
+	if (!fuzz_shared)
+		return;
+	LWLockAcquire(fuzz_shared->lock, LW_EXCLUSIVE);
+	stat->shared = hash_search(fuzz_shared_error_stats, &key,
+							   HASH_ENTER_NULL, &found);
+	if (stat->shared && !found) {
+		pg_atomic_init_u64(&stat->shared->count, 0);
+		memcpy(stat->shared->message, stat->message, FUZZ_ERROR_MESSAGE_LEN);
+		memcpy(stat->shared->first_input, stat->first_input,
+			   FUZZ_INPUT_HASH_LEN);
 	}
-	fprintf(stderr, "\n");
+	LWLockRelease(fuzz_shared->lock);
+	if (stat->shared)
+		pg_atomic_fetch_add_u64(&stat->shared->count, 1);
 }
 
+static int compare_error_stats(const void *a, const void *b) {
+	const LocalErrorStat *sa = *(LocalErrorStat * const *) a;
+	const LocalErrorStat *sb = *(LocalErrorStat * const *) b;
+
+	if (sa->key.sqlerrcode != sb->key.sqlerrcode)
+		return sa->key.sqlerrcode < sb->key.sqlerrcode ? -1 : 1;
+	return 0;
+}
+
+/* Print the counts per SQLSTATE as JSON for the progress reports */
 static void jsonb_errcode_counts() {
-	int i;
 	StringInfoData json_data, *json = &json_data;
+	HASH_SEQ_STATUS status;
+	LocalErrorStat **stats;
+	LocalErrorStat *stat;
+	long nstats = hash_get_num_entries(local_error_stats);
+	long i;
+	long n = 0;
+	uint64 count;
+
+	stats = palloc(Max(nstats, 1) * sizeof(LocalErrorStat *));
+	hash_seq_init(&status, local_error_stats);
+	while ((stat = hash_seq_search(&status)) != NULL)
+		stats[n++] = stat;
+	qsort(stats, n, sizeof(LocalErrorStat *), compare_error_stats);
 
 	initStringInfo(json);
 	appendStringInfoChar(json, '{');
-	for (i=0; i<num_counts; i++) {
-		appendStringInfo(json, "\"%s\": %d, ",
-						 unpack_sql_state(errcode_counts[i].errcode),
-						 errcode_counts[i].count);
-		if (i != num_counts-1)
-			appendStringInfoChar(json, ',');
+	i = 0;
+	while (i < n) {
+		int errcode = stats[i]->key.sqlerrcode;
+
+		for (count = 0; i < n && stats[i]->key.sqlerrcode == errcode; i++)
+			count += stats[i]->count;
+		appendStringInfo(json, "%s\"%s\": " UINT64_FORMAT,
+						 json->len > 1 ? ", " : "",
+						 unpack_sql_state(errcode), count);
 	}
 	appendStringInfoChar(json, '}');
 	fprintf(stderr, "JSON: %s\n", json->data);
+	pfree(json->data);
+	pfree(stats);
 }
 
+/*
+   Error statistics: how often each SQLSTATE and message template came
+   up and the hash (as in the corpus and crash- file names) of the input
+   that hit it first. With the library in shared_preload_libraries this
+   shows every backend that is fuzzing right now, live, otherwise just
+   the last fuzzing session of this one.
+
+   CREATE FUNCTION fuzz_error_stats(OUT pid integer, OUT sqlstate text,
+                                    OUT message text, OUT count bigint,
+                                    OUT first_input text)
+     RETURNS SETOF record AS 'test.so' LANGUAGE C STRICT;
+   CREATE VIEW fuzz_error_stats AS SELECT * FROM fuzz_error_stats();
+*/
+
+PG_FUNCTION_INFO_V1(fuzz_error_stats);
+Datum
+fuzz_error_stats(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext oldcontext;
+	HASH_SEQ_STATUS status;
+	Datum values[5];
+	bool nulls[5] = {false, false, false, false, false};
+
+	if (!rsinfo || !IsA(rsinfo, ReturnSetInfo) ||
+		!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+	tupdesc = CreateTupleDescCopy(tupdesc);
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+	MemoryContextSwitchTo(oldcontext);
+
+	if (fuzz_shared) {
+		SharedErrorStat *stat;
+
+		LWLockAcquire(fuzz_shared->lock, LW_SHARED);
+		hash_seq_init(&status, fuzz_shared_error_stats);
+		while ((stat = hash_seq_search(&status)) != NULL) {
+			values[0] = Int32GetDatum(stat->key.pid);
+			values[1] = CStringGetTextDatum(unpack_sql_state(stat->key.sqlerrcode));
+			values[2] = CStringGetTextDatum(stat->message);
+			values[3] = Int64GetDatum((int64) pg_atomic_read_u64(&stat->count));
+			values[4] = CStringGetTextDatum(stat->first_input);
+			tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+		}
+		LWLockRelease(fuzz_shared->lock);
+	} else if (local_error_stats) {
+		LocalErrorStat *stat;
+
+		hash_seq_init(&status, local_error_stats);
+		while ((stat = hash_seq_search(&status)) != NULL) {
+			values[0] = Int32GetDatum(stat->key.pid);
+			values[1] = CStringGetTextDatum(unpack_sql_state(stat->key.sqlerrcode));
+			values[2] = CStringGetTextDatum(stat->message);
+			values[3] = Int64GetDatum((int64) stat->count);
+			values[4] = CStringGetTextDatum(stat->first_input);
+			tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+		}
+	}
 
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
+
+
+
+
+/* Build the value of argument i from its slice of the input */
+static Datum make_arg_datum(int i, const char *Data, size_t Len) {
+	Oid typid = fuzz_argtypes[i];
+
+	if (typid == CSTRINGOID)
+		return CStringGetDatum(pnstrdup(Data, Len));
+	else if (direct_arg_is_raw(typid))
+		return PointerGetDatum(cstring_to_text_with_len(Data, Len));
+	else
+		return InputFunctionCall(&fuzz_input_flinfo[i], pnstrdup(Data, Len),
+								 fuzz_typioparams[i], -1);
+}
+
+/*
+ * Split the input into one slice per argument the way FuzzerFnAdapter.h
+ * unpacks strings: every slice but the last is prefixed by a single byte
+ * giving its length, the last one gets whatever is left over. With a
+ * single argument this is just the whole input. Arguments we run out of
+ * input for are empty.
+ *
+ * The length is the byte modulo the number of bytes left rather than the
+ * byte itself, since with -only_ascii=1 and -max_len=32 it is always
+ * larger than the input and the first slice would take everything.
+ */
+static void unpack_fuzz_args(const char *Data, size_t Size, Datum *values) {
+	const char *starts[FUZZ_MAX_ARGS];
+	size_t lens[FUZZ_MAX_ARGS];
+	bool any_empty = false;
+	int i;
+
+	for (i = 0; i < fuzz_nargs; i++) {
+		size_t len = Size;
+
+		if (i < fuzz_nargs - 1) {
+			len = 0;
+			if (Size > 0) {
+				len = (unsigned char) Data[0] % Size;
+				Data++;
+				Size--;
+			}
+		}
+		starts[i] = Data;
+		lens[i] = len;
+		any_empty |= len == 0;
+		Data += len;
+		Size -= len;
+	}
+	if (any_empty && fuzz_nargs > 1)
+		n_empty_args++;
+
+	for (i = 0; i < fuzz_nargs; i++) {
+		values[i] = make_arg_datum(i, starts[i], lens[i]);
+		if (fuzz_check_roundtrip && !direct_arg_is_raw(fuzz_argtypes[i]))
+			check_roundtrip(i, values[i]);
+	}
+}
+
+/* Call the fuzz_recv() target once on the raw input */
+static void call_recv(const char *Data, size_t Size) {
+	Datum value;
+
+	resetStringInfo(&fuzz_recv_buf);
+	appendBinaryStringInfo(&fuzz_recv_buf, Data, Size);
+
+	fuzz_fcinfo.isnull = false;
+	value = FunctionCallInvoke(&fuzz_fcinfo);
+
+	/* Same check as exec_bind_message() and record_recv() */
+	if (fuzz_recv_buf.cursor != fuzz_recv_buf.len)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+				 errmsg("incorrect binary data format")));
+
+	if (fuzz_check_roundtrip && !fuzz_fcinfo.isnull)
+		check_roundtrip(0, value);
+}
+
+/* Call the fuzz_function() target once on the unpacked arguments */
+static void call_direct(Datum *values) {
+	int i;
+
+	for (i = 0; i < fuzz_nargs; i++) {
+		fuzz_fcinfo.arg[i] = values[i];
+		fuzz_fcinfo.argnull[i] = false;
+	}
+	fuzz_fcinfo.isnull = false;
+	(void) FunctionCallInvoke(&fuzz_fcinfo);
+}
 
 /* 
  * Callback from fuzzer to execute one fuzz test case as set up in
- * global "plan" variable by fuzz() 
+ * global "plan" variable by fuzz() or by fuzz_function()
  */
 
 int FuzzOne(const char *Data, size_t Size) {
-	text *arg = cstring_to_text_with_len(Data, Size);
-
-	static unsigned long n_execs, n_success, n_fail, n_null;
-	static int last_error, last_error_count;
 	MemoryContext oldcontext = CurrentMemoryContext;
  	ResourceOwner oldowner = CurrentResourceOwner;
 
@@ -228,10 +1791,16 @@ int FuzzOne(const char *Data, size_t Size) {
 		return 0;
 	}
 
-	BeginInternalSubTransaction(NULL);
+	/* Reuse the subtransaction left open by the previous input unless
+	 * it errored out or filled up the batch */
+	if (!batch_count) {
+		BeginInternalSubTransaction(NULL);
+		batch_owner = CurrentResourceOwner;
+	} else
+		CurrentResourceOwner = batch_owner;
  	PG_TRY();
  	{
-		Datum values[1] = { PointerGetDatum(arg) };
+		Datum values[FUZZ_MAX_ARGS];
 		int retval;
 
 		/* Slow queries are bad but if they CHECK_FOR_INTERRUPTS often
@@ -241,28 +1810,44 @@ int FuzzOne(const char *Data, size_t Size) {
 		CHECK_FOR_INTERRUPTS();
 		enable_timeout_after(STATEMENT_TIMEOUT, 100);
 
-		retval = SPI_execute_plan(plan, values,
-								  NULL /* nulls */,
-								  true, /* read-only */
-								  0 /* max rows */);
-		disable_timeout(STATEMENT_TIMEOUT, true);
-
-		SPI_freetuptable(SPI_tuptable);
+		/* The arguments and anything the target allocates directly
+		 * live in fuzz_call_context until the end of this input */
+		MemoryContextSwitchTo(fuzz_call_context);
+		unpack_fuzz_args(Data, Size, values);
 
-		if (retval == SPI_OK_SELECT)
+		if (fuzz_mode == FUZZ_RECV) {
+			call_recv(Data, Size);
+			disable_timeout(STATEMENT_TIMEOUT, true);
 			n_success++;
-		else if (retval >= 0)
-			fprintf(stderr, "SPI reports non-select run retval=%d\n", retval);
-		else
-			abort();
+		} else if (fuzz_mode == FUZZ_FUNCTION) {
+			call_direct(values);
+			disable_timeout(STATEMENT_TIMEOUT, true);
+			n_success++;
+		} else {
+			retval = SPI_execute_plan(plan, values,
+									  NULL /* nulls */,
+									  true, /* read-only */
+									  0 /* max rows */);
+			disable_timeout(STATEMENT_TIMEOUT, true);
+
+			SPI_freetuptable(SPI_tuptable);
+
+			if (retval == SPI_OK_SELECT)
+				n_success++;
+			else if (retval >= 0)
+				fprintf(stderr, "SPI reports non-select run retval=%d\n", retval);
+			else
+				abort();
+		}
 
 		last_error_count = 0;
 		last_error = 0;
 
-		ReleaseCurrentSubTransaction();
 		MemoryContextSwitchTo(oldcontext);
+		MemoryContextReset(fuzz_call_context);
 		CurrentResourceOwner = oldowner;
-		SPI_restore_connection();
+		if (++batch_count >= batch_size)
+			release_batch();
  	}
  	PG_CATCH();
  	{
@@ -271,14 +1856,16 @@ int FuzzOne(const char *Data, size_t Size) {
 		disable_timeout(STATEMENT_TIMEOUT, true);
 
 		ErrorData  *edata = CopyErrorData();
-		inc_errcode_count(edata->sqlerrcode);
+		MemoryContextReset(fuzz_call_context);
+		count_error(edata, Data, Size);
+
 
+		bool stop = false;
 
 		/* Allow C-c to cancel the whole fuzzer */
 		if (edata->sqlerrcode == ERRCODE_QUERY_CANCELED &&
 			strstr(edata->message, "due to user request")) {
-			in_fuzzer = 0;
-			PG_RE_THROW();
+			stop = true;
 		} else if (last_error != edata->sqlerrcode) {
 			/* New error seen -- that's a good thing */
 			last_error = edata->sqlerrcode;
@@ -287,6 +1874,11 @@ int FuzzOne(const char *Data, size_t Size) {
 			/* If we're repeatedly hitting the same errcode over
 			 * and over abort because that's usually a sign the
 			 * harness isn't working properly */
+			stop = true;
+		}
+
+		/* A fork server child recovers first and stops below */
+		if (stop && !fuzz_in_child) {
 			in_fuzzer = 0;
 			PG_RE_THROW();
 		}
@@ -294,15 +1886,21 @@ int FuzzOne(const char *Data, size_t Size) {
 		/* Otherwise attempt to recover using the subtransaction */
 		FlushErrorState();
 
-		/* Abort the inner transaction */
+		/* Abort the inner transaction, along with any earlier inputs
+		 * of this batch which had nothing to commit anyway */
 		RollbackAndReleaseCurrentSubTransaction();
 		MemoryContextSwitchTo(oldcontext);
 		CurrentResourceOwner = oldowner;
+		batch_count = 0;
 
-		SPI_restore_connection();
+		if (fuzz_mode == FUZZ_PLAN)
+			SPI_restore_connection();
 
 		n_fail++;
 
+		if (stop)
+			fuzz_child_stop(edata, 0);
+
 		/* INTERNAL_ERROR is definitely a bug. The others debatable
 		 * but in particular we're interested in infinite recursion
 		 * caught by check_for_stack_depth() which shows up as
@@ -358,12 +1956,10 @@ int FuzzOne(const char *Data, size_t Size) {
 	}
 	PG_END_TRY();
 
-	pfree(arg);
-
 	/* Every power of two executions print progress */
 	if ((n_execs & (n_execs-1)) == 0) {
 		static int  old_n_execs;
-		fprintf(stderr, "FuzzOne n=%lu  success=%lu  fail=%lu  null=%lu\n", n_execs, n_success, n_fail, n_null);
+		fprintf(stderr, "FuzzOne n=%lu  success=%lu  fail=%lu  null=%lu  empty_args=%lu  roundtrip=%lu\n", n_execs, n_success, n_fail, n_null, n_empty_args, n_roundtrip);
 		jsonb_errcode_counts();
 		old_n_execs = n_execs;
 	}